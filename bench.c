@@ -0,0 +1,364 @@
+// Microbenchmarks for the kernels shared by findsp and findst. The program
+// source named by BENCH_SOURCE is compiled in whole, with its main renamed,
+// so the kernels measured here are exactly the ones that ship.
+#define main bench_program_main
+#include BENCH_SOURCE
+#undef main
+
+#define BENCH_MAX_KERNELS 16
+#define BENCH_REDUCERS 8
+
+typedef struct {
+    int edge_count;
+    char *text;
+    size_t text_size;
+    Pair *pairs;
+    Pair *work;
+    Adjacency adjacency;
+    Arena adjacency_arena;
+    AdjacencyCursor cursors[BENCH_REDUCERS];
+    Arena cursor_arenas[BENCH_REDUCERS];
+} BenchData;
+
+typedef struct {
+    const char *name;
+    double (*run)(BenchData *data);
+} BenchKernel;
+
+typedef struct {
+    const char *kernel;
+    double median;
+    double p99;
+    int compared;
+} BenchResult;
+
+// Keeps the compiler from discarding results that are otherwise unused.
+volatile uint64_t bench_sink;
+
+uint64_t bench_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+void bench_generate(BenchData *data, int edge_count) {
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    int max_vertex = edge_count / 10 > 1 ? edge_count / 10 : 2;
+    
+    data->edge_count = edge_count;
+    data->text = malloc((size_t)edge_count * 24);
+    data->pairs = malloc(edge_count * sizeof(Pair));
+    data->work = malloc(edge_count * sizeof(Pair));
+    
+    char *p = data->text;
+    for (int i = 0; i < edge_count; i++) {
+        int source = 1 + (int)(bench_random(&state) % max_vertex);
+        int dest = 1 + (int)(bench_random(&state) % max_vertex);
+        data->pairs[i].dest = dest;
+        data->pairs[i].source = source;
+        p += format_int(p, source);
+        *p++ = ' ';
+        p += format_int(p, dest);
+        *p++ = '\n';
+    }
+    data->text_size = (size_t)(p - data->text);
+    
+    memcpy(data->work, data->pairs, edge_count * sizeof(Pair));
+    group_pairs(data->work, edge_count, &data->adjacency, &data->adjacency_arena);
+    
+    // One cursor per reducer over its hash partition, as published for the
+    // final merge.
+    for (int r = 0; r < BENCH_REDUCERS; r++) {
+        PairBuffer partition = {0};
+        for (int i = 0; i < edge_count; i++) {
+            if (partition_dest(data->pairs[i].dest, BENCH_REDUCERS) == r) {
+                arena_append_pair(&partition, &data->cursor_arenas[r], data->pairs[i].dest, data->pairs[i].source);
+            }
+        }
+        
+        Adjacency adjacency;
+        group_pairs(partition.pairs, partition.count, &adjacency, &data->cursor_arenas[r]);
+        DestCount *counts = arena_alloc(&data->cursor_arenas[r], adjacency.dest_count * sizeof(DestCount) + 1);
+        for (int i = 0; i < adjacency.dest_count; i++) {
+            counts[i].destination = adjacency.dests[i];
+            counts[i].count = adjacency.offsets[i + 1] - adjacency.offsets[i];
+        }
+        data->cursors[r].counts = counts;
+        data->cursors[r].sources = adjacency.sources;
+        data->cursors[r].count = adjacency.dest_count;
+    }
+}
+
+void bench_release(BenchData *data) {
+    free(data->text);
+    free(data->pairs);
+    free(data->work);
+    arena_free(&data->adjacency_arena);
+    for (int r = 0; r < BENCH_REDUCERS; r++) {
+        arena_free(&data->cursor_arenas[r]);
+    }
+}
+
+double bench_parse(BenchData *data) {
+    const char *cursor = data->text;
+    const char *end = data->text + data->text_size;
+    int source, dest;
+    uint64_t sum = 0;
+    
+    double start = monotonic_seconds();
+    while (next_edge(&cursor, end, &source, &dest)) {
+        sum += (unsigned)source + (unsigned)dest;
+    }
+    double elapsed = monotonic_seconds() - start;
+    
+    bench_sink += sum;
+    return elapsed;
+}
+
+double bench_partition(BenchData *data) {
+    uint64_t sum = 0;
+    
+    double start = monotonic_seconds();
+    for (int i = 0; i < data->edge_count; i++) {
+        sum += partition_dest(data->pairs[i].dest, BENCH_REDUCERS);
+    }
+    double elapsed = monotonic_seconds() - start;
+    
+    bench_sink += sum;
+    return elapsed;
+}
+
+double bench_sort(BenchData *data) {
+    Arena arena = {0};
+    memcpy(data->work, data->pairs, data->edge_count * sizeof(Pair));
+    
+    double start = monotonic_seconds();
+    sort_pairs(data->work, data->edge_count, &arena);
+    double elapsed = monotonic_seconds() - start;
+    
+    arena_free(&arena);
+    return elapsed;
+}
+
+double bench_group(BenchData *data, int reducer_mode) {
+    Arena arena = {0};
+    Adjacency adjacency;
+    int saved_mode = options.reducer_mode;
+    options.reducer_mode = reducer_mode;
+    memcpy(data->work, data->pairs, data->edge_count * sizeof(Pair));
+    
+    double start = monotonic_seconds();
+    group_pairs(data->work, data->edge_count, &adjacency, &arena);
+    double elapsed = monotonic_seconds() - start;
+    
+    bench_sink += adjacency.dest_count;
+    options.reducer_mode = saved_mode;
+    arena_free(&arena);
+    return elapsed;
+}
+
+double bench_group_sort(BenchData *data) {
+    return bench_group(data, REDUCER_SORT);
+}
+
+double bench_group_hash(BenchData *data) {
+    return bench_group(data, REDUCER_HASH);
+}
+
+double bench_format(BenchData *data) {
+    OutputBuffer out;
+    output_open(&out, "/dev/null");
+    
+    double start = monotonic_seconds();
+    write_adjacency(&out, &data->adjacency);
+    output_flush(&out);
+    double elapsed = monotonic_seconds() - start;
+    
+    output_close(&out);
+    return elapsed;
+}
+
+void bench_count_entry(const DestCount *entry, const int *sources, void *context) {
+    *(uint64_t *)context += entry->count + (unsigned)sources[0];
+}
+
+double bench_merge(BenchData *data) {
+    uint64_t sum = 0;
+    
+    double start = monotonic_seconds();
+    merge_adjacency(data->cursors, BENCH_REDUCERS, bench_count_entry, &sum);
+    double elapsed = monotonic_seconds() - start;
+    
+    bench_sink += sum;
+    return elapsed;
+}
+
+BenchKernel bench_kernels[] = {
+    {"parse", bench_parse},
+    {"partition", bench_partition},
+    {"sort", bench_sort},
+    {"group_sort", bench_group_sort},
+    {"group_hash", bench_group_hash},
+    {"format", bench_format},
+    {"merge", bench_merge},
+};
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples.
+double percentile(const double *sorted, int count, int percent) {
+    int rank = (count * percent + 99) / 100;
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+void pin_to_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+#else
+    fprintf(stderr, "CPU pinning is not supported on this platform, running unpinned\n");
+#endif
+}
+
+// Compares each result with the baseline row for the same program, kernel
+// and edge count. Returns the number of kernels whose median got slower by
+// more than tolerance percent, plus the number that had no row to compare
+// against, so a stale or mismatched baseline cannot pass by comparing
+// nothing.
+int check_baseline(const char *path, const char *program, int edge_count, BenchResult *results,
+                   int result_count, double tolerance) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Error opening baseline file");
+        exit(1);
+    }
+    
+    int regressions = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        char base_program[64], kernel[64];
+        int edges, runs;
+        double median, p99;
+        if (sscanf(line, "%63[^,],%63[^,],%d,%d,%lf,%lf", base_program, kernel, &edges, &runs, &median, &p99) != 6) {
+            continue;
+        }
+        if (strcmp(base_program, program) != 0 || edges != edge_count) continue;
+        
+        for (int i = 0; i < result_count; i++) {
+            if (strcmp(results[i].kernel, kernel) != 0) continue;
+            results[i].compared = 1;
+            double change = (results[i].median / median - 1) * 100;
+            int slower = change > tolerance;
+            fprintf(stderr, "%s %-12s %10.3f ms -> %10.3f ms  %+7.1f%%%s\n", program, kernel, median,
+                    results[i].median, change, slower ? "  REGRESSION" : "");
+            regressions += slower;
+        }
+    }
+    
+    fclose(file);
+    
+    for (int i = 0; i < result_count; i++) {
+        if (results[i].compared) continue;
+        fprintf(stderr, "%s %-12s no baseline row for %d edges in %s  MISSING\n", program, results[i].kernel,
+                edge_count, path);
+        regressions++;
+    }
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    const char *program = BENCH_PROGRAM;
+    int edge_count = 1 << 20;
+    int runs = 21;
+    int warmup = 3;
+    int cpu = -1;
+    double tolerance = 10;
+    const char *baseline = NULL;
+    const char *only = NULL;
+    int header = 1;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--edges=", 8) == 0) {
+            edge_count = (int)parse_size(argv[i] + 8);
+        } else if (strncmp(argv[i], "--runs=", 7) == 0) {
+            runs = atoi(argv[i] + 7);
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--cpu=", 6) == 0) {
+            cpu = atoi(argv[i] + 6);
+        } else if (strncmp(argv[i], "--baseline=", 11) == 0) {
+            baseline = argv[i] + 11;
+        } else if (strncmp(argv[i], "--tolerance=", 12) == 0) {
+            tolerance = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+            only = argv[i] + 9;
+        } else if (strcmp(argv[i], "--no-header") == 0) {
+            header = 0;
+        } else {
+            fprintf(stderr, "Usage: %s [--edges=N[K|M|G]] [--runs=N] [--warmup=N] [--cpu=N] [--kernel=NAME] [--baseline=CSV] [--tolerance=PERCENT] [--no-header]\n", argv[0]);
+            exit(1);
+        }
+    }
+    
+    if (edge_count < 1 || runs < 1 || warmup < 0) {
+        fprintf(stderr, "edges and runs must be positive and warmup non-negative\n");
+        exit(1);
+    }
+    
+    if (cpu >= 0) {
+        pin_to_cpu(cpu);
+    }
+    
+    BenchData data = {0};
+    bench_generate(&data, edge_count);
+    
+    int kernel_count = sizeof(bench_kernels) / sizeof(bench_kernels[0]);
+    BenchResult results[BENCH_MAX_KERNELS];
+    int result_count = 0;
+    double *samples = malloc(runs * sizeof(double));
+    
+    if (header) {
+        printf("program,kernel,edges,runs,median_ms,p99_ms\n");
+    }
+    for (int k = 0; k < kernel_count; k++) {
+        BenchKernel *kernel = &bench_kernels[k];
+        if (only && strcmp(only, kernel->name) != 0) continue;
+        
+        for (int i = 0; i < warmup; i++) {
+            kernel->run(&data);
+        }
+        for (int i = 0; i < runs; i++) {
+            samples[i] = kernel->run(&data) * 1e3;
+        }
+        qsort(samples, runs, sizeof(double), compare_doubles);
+        
+        BenchResult *result = &results[result_count++];
+        result->kernel = kernel->name;
+        result->compared = 0;
+        result->median = percentile(samples, runs, 50);
+        result->p99 = percentile(samples, runs, 99);
+        printf("%s,%s,%d,%d,%.4f,%.4f\n", program, kernel->name, edge_count, runs, result->median, result->p99);
+        fflush(stdout);
+    }
+    
+    free(samples);
+    bench_release(&data);
+    
+    if (baseline && check_baseline(baseline, program, edge_count, results, result_count, tolerance) > 0) {
+        return 1;
+    }
+    return 0;
+}
@@ -1,16 +1,120 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <zlib.h>
+#include <math.h>
+#include <time.h>
+#include <sys/resource.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
-#define MAX_LINE_LENGTH 256
-#define MAX_VERTICES 1000000
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SIMD_PARSER 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_SIMD_PARSER 1
+#endif
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 8
+
+#ifndef RADIX_BITS
+#define RADIX_BITS 8
+#endif
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_SMALL_SORT 64
+#define SIGN_FLIP 0x80000000u
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_ALIGNMENT 4096
+
+#define OUTPUT_TEXT 0
+#define OUTPUT_CSR 1
+#define CSR_ADJACENCY_MAGIC "FINDCSR1"
+#define CSR_COUNTS_MAGIC "FINDCNT1"
+#define CSR_VERSION 1
+// The CSR layout spends 12 bytes on every dest in [min_dest, max_dest], so
+// it is only written when that span is within this many times the number of
+// dests plus CSR_SPAN_SLACK.
+#define CSR_MAX_SPAN_FACTOR 8
+#define CSR_SPAN_SLACK 65536
+
+#define INTERMEDIATE_TEXT 0
+#define INTERMEDIATE_BINARY 1
+#define INTERMEDIATE_VARINT 2
+
+#define REDUCER_SORT 0
+#define REDUCER_HASH 1
+
+#define COMBINE_BATCH_SIZE 65536
+
+#define PARTITION_HASH 0
+#define PARTITION_RANGE 1
+#define PARTITION_SAMPLES 65536
+
+#define INDEX_BLOCK_SIZE (64 << 10)
+#define RANGE_INDEX_MAGIC "FINDIDX1"
+#define RANGE_INDEX_VERSION 1
+
+#define SHUFFLE_SHM_NAME "/findsp_shuffle"
+#define SHM_RING_MIN_CAPACITY 1024
+#define RING_BATCH_SIZE 1024
+#define RUN_SIZE (1 << 20)
+
+#define STREAM_CHUNK_SIZE (4 << 20)
+#define STREAM_INPUT_SIZE (1 << 16)
+#define STREAM_SPILL_PAIRS (1 << 21)
+// A buffered pair costs itself plus a radix key and its scratch slot while
+// its run is sorted.
+#define SPILL_BYTES_PER_PAIR (sizeof(Pair) + 2 * sizeof(uint64_t))
+#define SPILL_MIN_PAIRS 4096
+
+#define SKETCH_DEFAULT_ERROR 0.02
+#define SKETCH_MIN_PRECISION 4
+#define SKETCH_MAX_PRECISION 16
+#define SKETCH_SPARSE_INITIAL 8
+
+#define IO_SYNC 0
+#define IO_URING 1
+#define IO_THREADS 2
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_DEFAULT_DEPTH 8
+#define IO_WORKERS 4
+#define IO_RING_ENTRIES 256
+#define IO_CHUNK_SIZE (1 << 20)
+#define IO_MAX_TRANSFER (1u << 30)
+#define INTERMEDIATE_BUFFER_SIZE (64 << 10)
+
+#define STATS_JSON 0
+#define STATS_CSV 1
+
+#define COUNTS_PENDING 0
+#define COUNTS_SHARED 1
+#define COUNTS_SPILLED 2
+#define COUNTS_STREAMED 3
 
 typedef struct {
     int destination;
@@ -22,260 +126,3741 @@ typedef struct {
     int source;
 } Pair;
 
-int compare_pairs(const void *a, const void *b) {
-    Pair *pa = (Pair *)a;
-    Pair *pb = (Pair *)b;
+typedef struct {
+    Pair *pairs;
+    int count;
+    int capacity;
+} PairBuffer;
+
+typedef struct {
+    int *dests;
+    int *offsets;
+    int *sources;
+    int dest_count;
+} Adjacency;
+
+typedef struct {
+    PairBuffer *batches;
+    uint64_t *keys;
+    uint64_t *scratch;
+} Combiner;
+
+typedef struct {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint32_t closed;
+    _Atomic uint32_t producer_waiting;
+} ShmRing;
+
+typedef struct {
+    _Atomic uint32_t sequence;
+    _Atomic uint32_t consumer_waiting;
+} ShmDoorbell;
+
+typedef struct {
+    void *base;
+    size_t size;
+    int R;
+    uint32_t capacity;
+    size_t header_size;
+    size_t ring_stride;
+    ShmDoorbell *doorbells;
+} ShuffleRegion;
+
+typedef struct {
+    _Atomic int state;
+    int count;
+    int source_count;
+    uint64_t offset;
+} CountExtent;
+
+typedef struct {
+    _Atomic uint64_t next_slot;
+    uint64_t slot_count;
+    uint64_t entries_offset;
+    CountExtent extents[];
+} CountRegion;
+
+// One reducer's published adjacency: (dest, count) entries in ascending dest
+// order, with each dest's sources stored back to back in sources.
+typedef struct {
+    const DestCount *counts;
+    const int *sources;
+    int count;
+    int position;
+    int source_position;
+} AdjacencyCursor;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t min_dest;
+    uint64_t dest_range;
+    uint64_t source_count;
+} CsrHeader;
+
+typedef struct {
+    int *fds;
+    int count;
+    int next;
+} PipeFanout;
+
+typedef struct {
+    const Pair *pairs;
+    int position;
+    int end;
+} RunCursor;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *head;
+    void *last;
+    size_t block_size;
+} Arena;
+
+// A destination's HyperLogLog sketch. Small sketches stay sparse: an
+// open-addressing set of source hashes that counts exactly. Past
+// options.sketch_sparse_limit hashes they switch to dense registers.
+typedef struct {
+    int dest;
+    int count;
+    int capacity;
+    uint64_t *hashes;
+    unsigned char *registers;
+} Sketch;
+
+typedef struct {
+    Sketch *sketches;
+    int count;
+    int capacity;
+    int *slots;
+    size_t slot_capacity;
+    Arena arena;
+} SketchTable;
+
+// One positioned read or write handed to the I/O backend, which advances
+// data, length and offset through short transfers. Its owner may only touch
+// it again after io_wait.
+typedef struct IoRequest {
+    int fd;
+    int opcode;
+    char *data;
+    size_t length;
+    int64_t offset;
+    int in_flight;
+    int done;
+    int error;
+    struct IoRequest *next;
+} IoRequest;
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int fd;
+    char *sq_ring;
+    size_t sq_ring_size;
+    char *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned cq_entries;
+    unsigned in_flight;
+    int reaping;
+} IoRing;
+#endif
+
+// Every thread of a process submits through the one engine, under its
+// mutex. The threads backend queues requests for its workers; the io_uring
+// backend shares one ring, and whichever waiter finds nobody else reaping
+// blocks in the kernel and completes requests for everyone.
+typedef struct {
+    int backend;
+    int started;
+    int stopping;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;
+    pthread_cond_t completed;
+    IoRequest *queue_head;
+    IoRequest *queue_tail;
+    pthread_t workers[IO_WORKERS];
+#ifdef HAVE_IO_URING
+    IoRing ring;
+#endif
+} IoEngine;
+
+// data is one of depth rotating buffers, filled while the others are
+// written. offset is where data[0] lands in the file, or -1 for a pipe or
+// device that must be written in order with a single buffer.
+typedef struct {
+    int fd;
+    int direct;
+    char *data;
+    size_t length;
+    size_t capacity;
+    int64_t offset;
+    int depth;
+    int current;
+    char **buffers;
+    IoRequest *requests;
+} OutputBuffer;
+
+typedef struct {
+    OutputBuffer *intermediate_files;
+    int mapper_index;
+    PairBuffer *ring_batches;
+    SketchTable *sketches;
+    uint64_t edges_parsed;
+    uint64_t edges_filtered;
+    uint64_t pairs_emitted;
+} MapperSink;
+
+typedef struct {
+    size_t offset;
+    size_t size;
+    size_t output_offset;
+    uint32_t output_size;
+} GzipMember;
+
+typedef void (*PairVisitor)(const Pair *pair, void *context);
+typedef void (*ChunkHandler)(char *data, size_t length, void *context);
+
+typedef struct {
+    int reducer_id;
+    int run_count;
+    uint64_t *keys;
+    uint64_t *scratch;
+    uint64_t pairs;
+    uint64_t dests;
+    uint64_t sources;
+} SpillRuns;
+
+typedef struct {
+    OutputBuffer counts;
+    OutputBuffer sources;
+    OutputBuffer text;
+    DestCount current;
+    uint64_t dest_total;
+    uint64_t source_total;
+} StreamedAdjacencyWriter;
+
+typedef struct {
+    char *counts;
+    size_t counts_size;
+    char *sources;
+    size_t sources_size;
+    int mapped;
+} StreamedAdjacency;
+
+typedef struct {
+    int shm_shuffle;
+    int intermediate_format;
+    int reducer_mode;
+    int combine;
+    int partition_mode;
+    int direct_output;
+    int reducer_outputs;
+    int output_format;
+    int streaming;
+    int spill_pairs;
+    int counts_only;
+    int approximate;
+    const char *index_path;
+    const char *previous_path;
+    int sketch_precision;
+    int sketch_sparse_limit;
+    const char *stats_path;
+    int stats_format;
+    int io_backend;
+    int io_depth;
+} Options;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t input_size;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint64_t block_count;
+} RangeIndexHeader;
+
+// A line-aligned block of the input: it starts at offset and runs to the
+// next block's offset, and every dest in it lies in [min_dest, max_dest].
+typedef struct {
+    uint64_t offset;
+    int32_t min_dest;
+    int32_t max_dest;
+} IndexBlock;
+
+typedef struct {
+    RangeIndexHeader header;
+    IndexBlock *blocks;
+} RangeIndex;
+
+typedef struct {
+    double start;
+    double end;
+    uint64_t edges_parsed;
+    uint64_t edges_filtered;
+    uint64_t pairs_emitted;
+} MapperStats;
+
+typedef struct {
+    double start;
+    double ingest_end;
+    double group_end;
+    double end;
+    uint64_t pairs_received;
+    uint64_t dests;
+    uint64_t sources;
+    int spill_runs;
+} ReducerStats;
+
+// Times are seconds on the monotonic clock since origin. The whole report
+// lives in one shared anonymous mapping so that forked workers can fill in
+// their own entries.
+typedef struct {
+    double origin;
+    double load_end;
+    double shuffle_end;
+    double merge_end;
+    _Atomic uint64_t bytes_written;
+    int M;
+    int R;
+    MapperStats *mappers;
+    ReducerStats *reducers;
+} RunStats;
+
+Options options;
+IoEngine io_engine = {IO_SYNC, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+// NULL unless --stats was given.
+RunStats *run_stats;
+int *range_boundaries;
+RangeIndex *range_index;
+ShuffleRegion shuffle_region;
+
+int parse_io_backend(const char *name) {
+    if (strcmp(name, "sync") == 0) return IO_SYNC;
+    if (strcmp(name, "uring") == 0) return IO_URING;
+    if (strcmp(name, "threads") == 0) return IO_THREADS;
+    fprintf(stderr, "Unknown I/O backend: %s\n", name);
+    exit(1);
+}
+
+// Accounts for a transfer that moved result bytes, or failed with -result,
+// and returns 1 once there is nothing left to retry.
+int io_advance(IoRequest *request, ssize_t result) {
+    if (result == -EINTR || result == -EAGAIN) return 0;
+    if (result < 0) {
+        request->error = (int)-result;
+        return 1;
+    }
+    if (result == 0) {
+        request->error = EIO;
+        return 1;
+    }
+    request->data += result;
+    request->length -= (size_t)result;
+    request->offset += result;
+    return request->length == 0;
+}
+
+void *io_worker(void *arg) {
+    IoEngine *engine = arg;
+    
+    pthread_mutex_lock(&engine->mutex);
+    while (1) {
+        while (!engine->queue_head && !engine->stopping) {
+            pthread_cond_wait(&engine->ready, &engine->mutex);
+        }
+        IoRequest *request = engine->queue_head;
+        if (!request) break;
+        engine->queue_head = request->next;
+        if (!engine->queue_head) engine->queue_tail = NULL;
+        pthread_mutex_unlock(&engine->mutex);
+        
+        int finished = 0;
+        while (!finished) {
+            ssize_t result = request->opcode == IO_WRITE
+                ? pwrite(request->fd, request->data, request->length, (off_t)request->offset)
+                : pread(request->fd, request->data, request->length, (off_t)request->offset);
+            finished = io_advance(request, result < 0 ? -errno : result);
+        }
+        
+        pthread_mutex_lock(&engine->mutex);
+        request->done = 1;
+        pthread_cond_broadcast(&engine->completed);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+// Sets up a ring through the raw syscalls, since liburing is not a
+// dependency. Returns 0 if the kernel has no io_uring, forbids it, or
+// lacks the plain read and write opcodes.
+int io_ring_setup(IoRing *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return 0;
+    
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        probe->last_op >= IORING_OP_WRITE && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        close(fd);
+        return 0;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size > 0 && ring->sq_ring != MAP_FAILED) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    
+    ring->fd = fd;
+    ring->sq_head = (_Atomic unsigned *)(ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *)(ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (_Atomic unsigned *)(ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *)(ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cq_ring + params.cq_off.cqes);
+    ring->cq_entries = params.cq_entries;
+    ring->in_flight = 0;
+    ring->reaping = 0;
+    return 1;
+}
+
+void io_ring_destroy(IoRing *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+#endif
+
+void io_ring_submit(IoEngine *engine, IoRequest *request);
+
+// Waits, with the mutex held, until the backend has completed something.
+// Under io_uring the first waiter in drops the mutex to block in the kernel,
+// then completes every request it finds and resubmits short transfers.
+void io_collect(IoEngine *engine) {
+#ifdef HAVE_IO_URING
+    IoRing *ring = &engine->ring;
+    if (engine->backend == IO_URING && !ring->reaping) {
+        ring->reaping = 1;
+        pthread_mutex_unlock(&engine->mutex);
+        int result = (int)syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        int error = errno;
+        pthread_mutex_lock(&engine->mutex);
+        if (result < 0 && error != EINTR) {
+            errno = error;
+            perror("io_uring_enter");
+            exit(1);
+        }
+        
+        IoRequest *retry = NULL;
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        unsigned tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            IoRequest *request = (IoRequest *)(uintptr_t)cqe->user_data;
+            ring->in_flight--;
+            if (io_advance(request, cqe->res)) {
+                request->done = 1;
+            } else {
+                request->next = retry;
+                retry = request;
+            }
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+        ring->reaping = 0;
+        pthread_cond_broadcast(&engine->completed);
+        
+        while (retry) {
+            IoRequest *request = retry;
+            retry = request->next;
+            io_ring_submit(engine, request);
+        }
+        return;
+    }
+#endif
+    pthread_cond_wait(&engine->completed, &engine->mutex);
+}
+
+#ifdef HAVE_IO_URING
+// Queues one SQE and enters the kernel until the submission queue is empty
+// again. Never lets more requests be in flight than the completion queue
+// holds, so that no completion can be dropped.
+void io_ring_submit(IoEngine *engine, IoRequest *request) {
+    IoRing *ring = &engine->ring;
+    while (ring->in_flight >= ring->cq_entries) {
+        io_collect(engine);
+    }
+    
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->opcode == IO_WRITE ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t)(uintptr_t)request->data;
+    sqe->len = request->length < IO_MAX_TRANSFER ? (unsigned)request->length : IO_MAX_TRANSFER;
+    sqe->off = (uint64_t)request->offset;
+    sqe->user_data = (uint64_t)(uintptr_t)request;
+    ring->sq_array[index] = index;
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    ring->in_flight++;
+    
+    while (1) {
+        unsigned pending = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) -
+            atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if (pending == 0) break;
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0) >= 0) continue;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EBUSY) {
+            io_collect(engine);
+            continue;
+        }
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+#else
+void io_ring_submit(IoEngine *engine, IoRequest *request) {
+}
+#endif
+
+void io_lock_for_fork(void) {
+    pthread_mutex_lock(&io_engine.mutex);
+}
+
+void io_unlock_after_fork(void) {
+    pthread_mutex_unlock(&io_engine.mutex);
+}
+
+// A forked child has neither the workers nor a ring of its own, so it
+// starts the engine over on its first request.
+void io_reset_after_fork(void) {
+    IoEngine *engine = &io_engine;
+#ifdef HAVE_IO_URING
+    if (engine->started && engine->backend == IO_URING) close(engine->ring.fd);
+#endif
+    engine->started = 0;
+    engine->stopping = 0;
+    engine->queue_head = NULL;
+    engine->queue_tail = NULL;
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->ready, NULL);
+    pthread_cond_init(&engine->completed, NULL);
+}
+
+// Called with the mutex held. io_uring falls back to the threads backend
+// where the kernel or the platform does not provide it, and the options
+// remember that for processes forked later.
+void io_start(IoEngine *engine) {
+    static int fork_handlers;
+    if (!fork_handlers) {
+        pthread_atfork(io_lock_for_fork, io_unlock_after_fork, io_reset_after_fork);
+        fork_handlers = 1;
+    }
+    
+    engine->backend = options.io_backend;
+    if (engine->backend == IO_URING) {
+#ifdef HAVE_IO_URING
+        if (!io_ring_setup(&engine->ring, IO_RING_ENTRIES)) {
+            fprintf(stderr, "io_uring is unavailable, using --io=threads\n");
+            engine->backend = options.io_backend = IO_THREADS;
+        }
+#else
+        fprintf(stderr, "io_uring is not supported on this platform, using --io=threads\n");
+        engine->backend = options.io_backend = IO_THREADS;
+#endif
+    }
+    if (engine->backend == IO_THREADS) {
+        for (int i = 0; i < IO_WORKERS; i++) {
+            if (pthread_create(&engine->workers[i], NULL, io_worker, engine) != 0) {
+                perror("Failed to create I/O thread");
+                exit(1);
+            }
+        }
+    }
+    engine->started = 1;
+}
+
+void io_init(void) {
+    pthread_mutex_lock(&io_engine.mutex);
+    if (!io_engine.started) io_start(&io_engine);
+    pthread_mutex_unlock(&io_engine.mutex);
+}
+
+void io_submit(IoRequest *request, int opcode, int fd, char *data, size_t length, int64_t offset) {
+    IoEngine *engine = &io_engine;
+    request->fd = fd;
+    request->opcode = opcode;
+    request->data = data;
+    request->length = length;
+    request->offset = offset;
+    request->in_flight = 1;
+    request->done = 0;
+    request->error = 0;
+    request->next = NULL;
+    
+    pthread_mutex_lock(&engine->mutex);
+    if (!engine->started) io_start(engine);
+    if (engine->backend == IO_URING) {
+        io_ring_submit(engine, request);
+    } else {
+        if (engine->queue_tail) {
+            engine->queue_tail->next = request;
+        } else {
+            engine->queue_head = request;
+        }
+        engine->queue_tail = request;
+        pthread_cond_signal(&engine->ready);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+// Blocks until request is complete; a failed transfer ends the run, as a
+// failed blocking write does.
+void io_wait(IoRequest *request) {
+    if (!request->in_flight) return;
+    
+    IoEngine *engine = &io_engine;
+    pthread_mutex_lock(&engine->mutex);
+    while (!request->done) {
+        io_collect(engine);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+    
+    request->in_flight = 0;
+    if (request->error) {
+        errno = request->error;
+        perror(request->opcode == IO_WRITE ? "write" : "read");
+        exit(1);
+    }
+}
+
+void io_stop(void) {
+    IoEngine *engine = &io_engine;
+    pthread_mutex_lock(&engine->mutex);
+    if (!engine->started) {
+        pthread_mutex_unlock(&engine->mutex);
+        return;
+    }
+    engine->stopping = 1;
+    pthread_cond_broadcast(&engine->ready);
+    pthread_mutex_unlock(&engine->mutex);
+    
+    if (engine->backend == IO_THREADS) {
+        for (int i = 0; i < IO_WORKERS; i++) {
+            pthread_join(engine->workers[i], NULL);
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (engine->backend == IO_URING) io_ring_destroy(&engine->ring);
+#endif
+    engine->started = 0;
+    engine->stopping = 0;
+}
+
+// Reads the file into private anonymous memory with up to --io-depth
+// IO_CHUNK_SIZE reads in flight, rather than faulting it in through a
+// mapping a page range at a time.
+char *read_fd(int fd, size_t size) {
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
     
-    if (pa->dest != pb->dest) {
-        return pa->dest - pb->dest;
+    IoRequest *requests = calloc(options.io_depth, sizeof(IoRequest));
+    size_t chunk_count = (size + IO_CHUNK_SIZE - 1) / IO_CHUNK_SIZE;
+    for (size_t i = 0; i < chunk_count; i++) {
+        IoRequest *request = &requests[i % options.io_depth];
+        io_wait(request);
+        
+        size_t offset = i * IO_CHUNK_SIZE;
+        size_t length = size - offset < IO_CHUNK_SIZE ? size - offset : IO_CHUNK_SIZE;
+        io_submit(request, IO_READ, fd, data + offset, length, (int64_t)offset);
     }
-    return pa->source - pb->source;
+    for (int i = 0; i < options.io_depth; i++) {
+        io_wait(&requests[i]);
+    }
+    free(requests);
+    return data;
 }
 
-int compare_dest_counts(const void *a, const void *b) {
-    DestCount *da = (DestCount *)a;
-    DestCount *db = (DestCount *)b;
-    return da->destination - db->destination;
+char *map_fd(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+    
+    if (options.io_backend != IO_SYNC && *size >= IO_CHUNK_SIZE) {
+        char *data = read_fd(fd, *size);
+        close(fd);
+        return data;
+    }
+    
+    char *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    madvise(data, *size, MADV_SEQUENTIAL);
+    
+    close(fd);
+    return data;
 }
 
-void split_input_file(const char *input_file, int M) {
-    FILE *infile = fopen(input_file, "r");
-    if (!infile) {
+char *map_input_file(const char *input_file, size_t *size) {
+    int fd = open(input_file, O_RDONLY);
+    if (fd == -1) {
         perror("Error opening input file");
         exit(1);
     }
+    return map_fd(fd, size);
+}
+
+void unmap_file(char *data, size_t size) {
+    if (data != NULL && munmap(data, size) == -1) {
+        perror("munmap");
+    }
+}
+
+int is_gzip(const char *data, size_t size) {
+    const unsigned char *p = (const unsigned char *)data;
+    return size >= 18 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8;
+}
+
+// Returns the total length of the BGZF block at p, taken from the BC extra
+// subfield, or 0 if p does not start one.
+size_t bgzf_block_size(const unsigned char *p, size_t remaining) {
+    if (remaining < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || !(p[3] & 0x04)) return 0;
+    
+    size_t extra_length = p[10] | (p[11] << 8);
+    if (12 + extra_length > remaining) return 0;
+    
+    for (size_t i = 12; i + 4 <= 12 + extra_length; ) {
+        size_t field_length = p[i + 2] | (p[i + 3] << 8);
+        if (p[i] == 'B' && p[i + 1] == 'C' && field_length == 2 && i + 6 <= 12 + extra_length) {
+            size_t block_size = (size_t)(p[i + 4] | (p[i + 5] << 8)) + 1;
+            if (block_size < 12 + extra_length + 8 || block_size > remaining) return 0;
+            return block_size;
+        }
+        i += 4 + field_length;
+    }
+    return 0;
+}
+
+// Every BGZF block records its compressed length in the header and its
+// uncompressed length in the trailer, so an index of output offsets can be
+// built without inflating anything. Returns NULL for ordinary gzip.
+GzipMember *index_bgzf_members(const char *data, size_t size, int *member_count, size_t *total_size) {
+    const unsigned char *p = (const unsigned char *)data;
+    int capacity = 1024;
+    int count = 0;
+    GzipMember *members = malloc(capacity * sizeof(GzipMember));
+    size_t offset = 0;
+    size_t output_offset = 0;
+    
+    while (offset < size) {
+        size_t block_size = bgzf_block_size(p + offset, size - offset);
+        if (block_size == 0) {
+            free(members);
+            return NULL;
+        }
+        
+        if (count == capacity) {
+            capacity *= 2;
+            members = realloc(members, capacity * sizeof(GzipMember));
+        }
+        const unsigned char *trailer = p + offset + block_size - 4;
+        members[count].offset = offset;
+        members[count].size = block_size;
+        members[count].output_offset = output_offset;
+        members[count].output_size = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+        output_offset += members[count].output_size;
+        offset += block_size;
+        count++;
+    }
+    
+    *member_count = count;
+    *total_size = output_offset;
+    return members;
+}
+
+// Shared so that findsp's forked decompressors fill the parent's buffer.
+char *map_anonymous(size_t size) {
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return data;
+}
+
+// Empty members, such as the BGZF EOF block, have nothing to inflate, and
+// output may be NULL when every member is empty.
+void inflate_member(const char *data, const GzipMember *member, char *output) {
+    if (member->output_size == 0) return;
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "inflateInit2 failed\n");
+        exit(1);
+    }
+    
+    stream.next_in = (Bytef *)(data + member->offset);
+    stream.avail_in = (uInt)member->size;
+    stream.next_out = (Bytef *)(output + member->output_offset);
+    stream.avail_out = member->output_size;
+    
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.total_out != member->output_size) {
+        fprintf(stderr, "Corrupt BGZF block at offset %zu\n", member->offset);
+        exit(1);
+    }
+    inflateEnd(&stream);
+}
+
+// Plain gzip (including concatenated members) has no index, so it is
+// inflated in one pass into a mapping that doubles as it fills.
+char *inflate_serial(const char *data, size_t size, size_t *output_size) {
+    size_t capacity = size * 4 > (1 << 20) ? size * 4 : (1 << 20);
+    char *output = map_anonymous(capacity);
+    size_t length = 0;
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "inflateInit2 failed\n");
+        exit(1);
+    }
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)(size < UINT_MAX ? size : UINT_MAX);
+    size_t consumed = 0;
+    
+    while (1) {
+        if (length == capacity) {
+            char *grown = map_anonymous(capacity * 2);
+            memcpy(grown, output, length);
+            munmap(output, capacity);
+            output = grown;
+            capacity *= 2;
+        }
+        size_t room = capacity - length;
+        stream.next_out = (Bytef *)(output + length);
+        stream.avail_out = (uInt)(room < UINT_MAX ? room : UINT_MAX);
+        uInt before_in = stream.avail_in;
+        uInt before_out = stream.avail_out;
+        
+        int status = inflate(&stream, Z_NO_FLUSH);
+        consumed += before_in - stream.avail_in;
+        length += before_out - stream.avail_out;
+        
+        if (status == Z_STREAM_END) {
+            if (!is_gzip(data + consumed, size - consumed)) break;
+            inflateReset(&stream);
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            fprintf(stderr, "Corrupt gzip input\n");
+            exit(1);
+        } else if (status == Z_BUF_ERROR && stream.avail_out != 0 && stream.avail_in == 0 && consumed == size) {
+            fprintf(stderr, "Truncated gzip input\n");
+            exit(1);
+        }
+        if (stream.avail_in == 0) {
+            stream.next_in = (Bytef *)(data + consumed);
+            stream.avail_in = (uInt)(size - consumed < UINT_MAX ? size - consumed : UINT_MAX);
+        }
+    }
+    inflateEnd(&stream);
+    
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t kept = (length + page_size - 1) / page_size * page_size;
+    if (kept < capacity) {
+        munmap(output + kept, capacity - kept);
+    }
+    
+    *output_size = length;
+    return length > 0 ? output : NULL;
+}
+
+// Maps INFILE and, when it starts with a gzip header, replaces it with its
+// decompressed contents. BGZF blocks are inflated by M forked children
+// straight into their final offsets of a shared mapping, so mappers see the
+// same flat buffer as for text.
+char *load_input(const char *input_file, size_t *size, int workers) {
+    size_t compressed_size;
+    char *compressed = map_input_file(input_file, &compressed_size);
+    if (!is_gzip(compressed, compressed_size)) {
+        *size = compressed_size;
+        return compressed;
+    }
+    
+    int member_count;
+    size_t total_size;
+    GzipMember *members = index_bgzf_members(compressed, compressed_size, &member_count, &total_size);
+    char *data;
+    
+    if (members == NULL) {
+        data = inflate_serial(compressed, compressed_size, size);
+    } else {
+        data = total_size > 0 ? map_anonymous(total_size) : NULL;
+        if (workers > member_count) workers = member_count;
+        
+        for (int i = 0; i < workers; i++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                int first = (int)((long)member_count * i / workers);
+                int last = (int)((long)member_count * (i + 1) / workers);
+                for (int j = first; j < last; j++) {
+                    inflate_member(compressed, &members[j], data);
+                }
+                exit(0);
+            } else if (pid < 0) {
+                perror("Fork failed for decompressor");
+                exit(1);
+            }
+        }
+        
+        int failed = 0;
+        for (int i = 0; i < workers; i++) {
+            int status;
+            wait(&status);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+        }
+        if (failed) {
+            fprintf(stderr, "Error decompressing input\n");
+            exit(1);
+        }
+        
+        free(members);
+        *size = total_size;
+    }
+    
+    unmap_file(compressed, compressed_size);
+    return data;
+}
+
+size_t align_to_line(const char *data, size_t size, size_t offset) {
+    if (offset == 0) return 0;
+    while (offset < size && data[offset - 1] != '\n') {
+        offset++;
+    }
+    return offset;
+}
+
+#ifdef HAVE_SIMD_PARSER
+#if defined(__SSE2__)
+void classify_chunk(const char *p, unsigned *digits, unsigned *spaces) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(chunk, _mm_set1_epi8('9' + 1)));
+    __m128i is_space = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n'))),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r'))));
+    *digits = (unsigned)_mm_movemask_epi8(is_digit);
+    *spaces = (unsigned)_mm_movemask_epi8(is_space);
+}
+#else
+unsigned neon_movemask(uint8x16_t v) {
+    static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t bits = vandq_u8(v, vld1q_u8(weights));
+    return vaddv_u8(vget_low_u8(bits)) | ((unsigned)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+void classify_chunk(const char *p, unsigned *digits, unsigned *spaces) {
+    uint8x16_t chunk = vld1q_u8((const uint8_t *)p);
+    uint8x16_t is_digit = vandq_u8(vcgeq_u8(chunk, vdupq_n_u8('0')), vcleq_u8(chunk, vdupq_n_u8('9')));
+    uint8x16_t is_space = vorrq_u8(vorrq_u8(vceqq_u8(chunk, vdupq_n_u8(' ')), vceqq_u8(chunk, vdupq_n_u8('\n'))),
+                                   vorrq_u8(vceqq_u8(chunk, vdupq_n_u8('\t')), vceqq_u8(chunk, vdupq_n_u8('\r'))));
+    *digits = neon_movemask(is_digit);
+    *spaces = neon_movemask(is_space);
+}
+#endif
+
+int digits_to_int(const char *p, unsigned length) {
+    long result = 0;
+    for (unsigned i = 0; i < length; i++) {
+        result = result * 10 + (p[i] - '0');
+    }
+    return (int)result;
+}
+
+// Parses both numbers of a "src dst" line out of one 16-byte chunk. Returns 0
+// (without consuming anything) whenever the line does not fit the fast path,
+// e.g. signs, long gaps or a number running past the chunk.
+int parse_edge_simd(const char **cursor, int *first, int *second) {
+    const char *p = *cursor;
+    unsigned digits, spaces;
+    classify_chunk(p, &digits, &spaces);
+    
+    unsigned start1 = __builtin_ctz(digits | 0x10000);
+    if (start1 >= 16 || (~spaces & ((1u << start1) - 1))) return 0;
+    unsigned stop1 = start1 + __builtin_ctz(~(digits >> start1));
+    if (stop1 >= 16) return 0;
+    
+    unsigned rest = digits & ~((1u << stop1) - 1);
+    unsigned start2 = __builtin_ctz(rest | 0x10000);
+    if (start2 >= 16 || (~spaces & ((1u << start2) - 1) & ~((1u << stop1) - 1))) return 0;
+    unsigned stop2 = start2 + __builtin_ctz(~(digits >> start2));
+    if (stop2 >= 16) return 0;
+    
+    *first = digits_to_int(p + start1, stop1 - start1);
+    *second = digits_to_int(p + start2, stop2 - start2);
+    *cursor = p + stop2;
+    return 1;
+}
+#endif
+
+int parse_int(const char **cursor, const char *end, int *value) {
+    const char *p = *cursor;
+    
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    
+    if (p >= end || *p < '0' || *p > '9') return 0;
+    
+    long result = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    
+    *value = (int)(negative ? -result : result);
+    *cursor = p;
+    return 1;
+}
+
+int next_edge(const char **cursor, const char *end, int *source, int *dest) {
+    const char *p = *cursor;
+    
+#ifdef HAVE_SIMD_PARSER
+    if (end - p >= 16 && parse_edge_simd(cursor, source, dest)) return 1;
+#endif
+    
+    if (!parse_int(&p, end, source)) return 0;
+    if (!parse_int(&p, end, dest)) return 0;
+    
+    *cursor = p;
+    return 1;
+}
+
+size_t arena_round(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = arena_round(size);
+    ArenaBlock *block = arena->head;
+    
+    if (!block || block->used + size > block->capacity) {
+        size_t capacity = arena->block_size ? arena->block_size : ARENA_BLOCK_SIZE;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (!block) {
+            perror("Error allocating arena block");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->capacity = capacity;
+        block->used = 0;
+        arena->head = block;
+        arena->block_size = capacity * 2;
+    }
+    
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+// Grows the most recent allocation in place when the current block has room,
+// otherwise moves it to a fresh allocation. The old copy is reclaimed only by
+// arena_free.
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr != NULL && ptr == arena->last) {
+        ArenaBlock *block = arena->head;
+        size_t offset = (char *)ptr - block->data;
+        if (offset + arena_round(new_size) <= block->capacity) {
+            block->used = offset + arena_round(new_size);
+            return ptr;
+        }
+    }
+    
+    void *grown = arena_alloc(arena, new_size);
+    if (old_size > 0) {
+        memcpy(grown, ptr, old_size);
+    }
+    return grown;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->last = NULL;
+    arena->block_size = 0;
+}
+
+void reserve_pairs(PairBuffer *buffer, Arena *arena, int needed) {
+    if (needed <= buffer->capacity) return;
+    
+    int capacity = buffer->capacity ? buffer->capacity : 1024;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    buffer->pairs = arena_grow(arena, buffer->pairs, buffer->count * sizeof(Pair), capacity * sizeof(Pair));
+    buffer->capacity = capacity;
+}
+
+void arena_append_pair(PairBuffer *buffer, Arena *arena, int dest, int source) {
+    if (buffer->count == buffer->capacity) {
+        reserve_pairs(buffer, arena, buffer->count + 1);
+    }
+    buffer->pairs[buffer->count].dest = dest;
+    buffer->pairs[buffer->count].source = source;
+    buffer->count++;
+}
+
+uint64_t pair_key(const Pair *pair) {
+    return ((uint64_t)((uint32_t)pair->dest ^ SIGN_FLIP) << 32) | ((uint32_t)pair->source ^ SIGN_FLIP);
+}
+
+// Stable LSD radix sort of keys on bits [low_bit, 64). Passes in which every
+// key has the same digit are skipped, so small vertex ids only pay for the
+// digits they actually use.
+void radix_sort_keys(uint64_t *keys, uint64_t *scratch, size_t count, int low_bit) {
+    if (count < RADIX_SMALL_SORT) {
+        for (size_t i = 1; i < count; i++) {
+            uint64_t key = keys[i];
+            size_t j = i;
+            while (j > 0 && (keys[j - 1] >> low_bit) > (key >> low_bit)) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = key;
+        }
+        return;
+    }
+    
+    int passes = (64 - low_bit + RADIX_BITS - 1) / RADIX_BITS;
+    size_t (*histograms)[RADIX_BUCKETS] = calloc(passes, sizeof(*histograms));
+    
+    for (size_t i = 0; i < count; i++) {
+        for (int p = 0; p < passes; p++) {
+            histograms[p][(keys[i] >> (low_bit + p * RADIX_BITS)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+    
+    uint64_t *src = keys;
+    uint64_t *dst = scratch;
+    
+    for (int p = 0; p < passes; p++) {
+        int shift = low_bit + p * RADIX_BITS;
+        size_t *histogram = histograms[p];
+        if (histogram[(src[0] >> shift) & (RADIX_BUCKETS - 1)] == count) continue;
+        
+        size_t offset = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            size_t bucket = histogram[b];
+            histogram[b] = offset;
+            offset += bucket;
+        }
+        
+        for (size_t i = 0; i < count; i++) {
+            dst[histogram[(src[i] >> shift) & (RADIX_BUCKETS - 1)]++] = src[i];
+        }
+        
+        uint64_t *temp = src;
+        src = dst;
+        dst = temp;
+    }
+    
+    if (src != keys) {
+        memcpy(keys, src, count * sizeof(uint64_t));
+    }
+    free(histograms);
+}
+
+void sort_pairs_with_scratch(Pair *pairs, int count, uint64_t *keys, uint64_t *scratch) {
+    for (int i = 0; i < count; i++) {
+        keys[i] = pair_key(&pairs[i]);
+    }
+    radix_sort_keys(keys, scratch, count, 0);
+    for (int i = 0; i < count; i++) {
+        pairs[i].dest = (int)((uint32_t)(keys[i] >> 32) ^ SIGN_FLIP);
+        pairs[i].source = (int)((uint32_t)keys[i] ^ SIGN_FLIP);
+    }
+}
+
+void sort_pairs(Pair *pairs, int count, Arena *arena) {
+    if (count < 2) return;
+    
+    uint64_t *keys = arena_alloc(arena, count * sizeof(uint64_t));
+    uint64_t *scratch = arena_alloc(arena, count * sizeof(uint64_t));
+    sort_pairs_with_scratch(pairs, count, keys, scratch);
+}
+
+void combiner_init(Combiner *combiner, int R) {
+    combiner->batches = calloc(R, sizeof(PairBuffer));
+    for (int r = 0; r < R; r++) {
+        combiner->batches[r].pairs = malloc(COMBINE_BATCH_SIZE * sizeof(Pair));
+        combiner->batches[r].capacity = COMBINE_BATCH_SIZE;
+    }
+    combiner->keys = malloc(COMBINE_BATCH_SIZE * sizeof(uint64_t));
+    combiner->scratch = malloc(COMBINE_BATCH_SIZE * sizeof(uint64_t));
+}
+
+void combiner_free(Combiner *combiner, int R) {
+    for (int r = 0; r < R; r++) {
+        free(combiner->batches[r].pairs);
+    }
+    free(combiner->batches);
+    free(combiner->keys);
+    free(combiner->scratch);
+}
+
+// Returns 1 once the reducer's batch is full and has to be flushed.
+int combiner_add(Combiner *combiner, int reducer_index, int dest, int source) {
+    PairBuffer *batch = &combiner->batches[reducer_index];
+    batch->pairs[batch->count].dest = dest;
+    batch->pairs[batch->count].source = source;
+    batch->count++;
+    return batch->count == batch->capacity;
+}
+
+PairBuffer *combine_batch(Combiner *combiner, int reducer_index) {
+    PairBuffer *batch = &combiner->batches[reducer_index];
+    sort_pairs_with_scratch(batch->pairs, batch->count, combiner->keys, combiner->scratch);
+    
+    int unique = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (unique > 0 && batch->pairs[i].dest == batch->pairs[unique - 1].dest &&
+            batch->pairs[i].source == batch->pairs[unique - 1].source) continue;
+        batch->pairs[unique++] = batch->pairs[i];
+    }
+    batch->count = unique;
+    return batch;
+}
+
+// With counts_only the sources are only counted, and adjacency->sources is
+// left NULL.
+void group_sorted_pairs(const Pair *pairs, int count, Adjacency *adjacency, Arena *arena) {
+    adjacency->dests = arena_alloc(arena, count * sizeof(int));
+    adjacency->offsets = arena_alloc(arena, (count + 1) * sizeof(int));
+    adjacency->sources = options.counts_only ? NULL : arena_alloc(arena, count * sizeof(int));
+    
+    int *sources = adjacency->sources;
+    int dest_count = 0;
+    int source_count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        if (i == 0 || pairs[i].dest != pairs[i - 1].dest) {
+            adjacency->dests[dest_count] = pairs[i].dest;
+            adjacency->offsets[dest_count] = source_count;
+            dest_count++;
+        } else if (pairs[i].source == pairs[i - 1].source) {
+            continue;
+        }
+        if (sources) sources[source_count] = pairs[i].source;
+        source_count++;
+    }
+    
+    adjacency->offsets[dest_count] = source_count;
+    adjacency->dest_count = dest_count;
+}
+
+uint64_t mix_hash(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+size_t hash_capacity(int count) {
+    size_t capacity = 16;
+    while (capacity < (size_t)count * 2) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+void sort_ints(int *values, int count, uint64_t *keys, uint64_t *scratch) {
+    for (int i = 0; i < count; i++) {
+        keys[i] = (uint32_t)values[i] ^ SIGN_FLIP;
+    }
+    radix_sort_keys(keys, scratch, count, 0);
+    for (int i = 0; i < count; i++) {
+        values[i] = (int)((uint32_t)keys[i] ^ SIGN_FLIP);
+    }
+}
+
+// Groups pairs without sorting them: an open-addressing set drops duplicate
+// edges and a second table maps each destination to its group. Only the
+// distinct destinations, and each destination's own sources, are sorted.
+// The pairs array is reused as scratch and is clobbered.
+void group_pairs_hashed(Pair *pairs, int count, Adjacency *adjacency, Arena *arena) {
+    size_t capacity = hash_capacity(count);
+    size_t mask = capacity - 1;
+    
+    uint64_t *edge_keys = arena_alloc(arena, capacity * sizeof(uint64_t));
+    unsigned char *edge_used = arena_alloc(arena, capacity);
+    int *dest_slots = arena_alloc(arena, capacity * sizeof(int));
+    int *group_dests = arena_alloc(arena, count * sizeof(int));
+    int *group_sizes = arena_alloc(arena, count * sizeof(int));
+    memset(edge_used, 0, capacity);
+    memset(dest_slots, 0, capacity * sizeof(int));
+    
+    int group_count = 0;
+    int distinct = 0;
+    
+    for (int i = 0; i < count; i++) {
+        int dest = pairs[i].dest;
+        int source = pairs[i].source;
+        uint64_t key = ((uint64_t)(uint32_t)dest << 32) | (uint32_t)source;
+        
+        size_t slot = mix_hash(key) & mask;
+        while (edge_used[slot] && edge_keys[slot] != key) {
+            slot = (slot + 1) & mask;
+        }
+        if (edge_used[slot]) continue;
+        edge_used[slot] = 1;
+        edge_keys[slot] = key;
+        
+        size_t dest_slot = mix_hash((uint32_t)dest) & mask;
+        while (dest_slots[dest_slot] && group_dests[dest_slots[dest_slot] - 1] != dest) {
+            dest_slot = (dest_slot + 1) & mask;
+        }
+        if (!dest_slots[dest_slot]) {
+            group_dests[group_count] = dest;
+            group_sizes[group_count] = 0;
+            dest_slots[dest_slot] = ++group_count;
+        }
+        
+        int group = dest_slots[dest_slot] - 1;
+        group_sizes[group]++;
+        pairs[distinct].dest = group;
+        pairs[distinct].source = source;
+        distinct++;
+    }
+    
+    uint64_t *order = arena_alloc(arena, group_count * sizeof(uint64_t));
+    uint64_t *order_scratch = arena_alloc(arena, group_count * sizeof(uint64_t));
+    for (int g = 0; g < group_count; g++) {
+        order[g] = ((uint64_t)((uint32_t)group_dests[g] ^ SIGN_FLIP) << 32) | (uint32_t)g;
+    }
+    radix_sort_keys(order, order_scratch, group_count, 32);
+    
+    adjacency->dests = arena_alloc(arena, group_count * sizeof(int));
+    adjacency->offsets = arena_alloc(arena, (group_count + 1) * sizeof(int));
+    adjacency->sources = options.counts_only ? NULL : arena_alloc(arena, distinct * sizeof(int));
+    adjacency->dest_count = group_count;
+    
+    int *group_cursor = arena_alloc(arena, group_count * sizeof(int));
+    int offset = 0;
+    int largest = 0;
+    
+    for (int r = 0; r < group_count; r++) {
+        int g = (int)(uint32_t)order[r];
+        adjacency->dests[r] = group_dests[g];
+        adjacency->offsets[r] = offset;
+        group_cursor[g] = offset;
+        offset += group_sizes[g];
+        if (group_sizes[g] > largest) largest = group_sizes[g];
+    }
+    adjacency->offsets[group_count] = offset;
+    
+    if (options.counts_only) {
+        adjacency->sources = NULL;
+        return;
+    }
+    
+    for (int i = 0; i < distinct; i++) {
+        adjacency->sources[group_cursor[pairs[i].dest]++] = pairs[i].source;
+    }
+    
+    uint64_t *keys = arena_alloc(arena, largest * sizeof(uint64_t));
+    uint64_t *scratch = arena_alloc(arena, largest * sizeof(uint64_t));
+    for (int r = 0; r < group_count; r++) {
+        int start = adjacency->offsets[r];
+        sort_ints(adjacency->sources + start, adjacency->offsets[r + 1] - start, keys, scratch);
+    }
+}
+
+void group_pairs(Pair *pairs, int count, Adjacency *adjacency, Arena *arena) {
+    if (options.reducer_mode == REDUCER_HASH) {
+        group_pairs_hashed(pairs, count, adjacency, arena);
+    } else {
+        sort_pairs(pairs, count, arena);
+        group_sorted_pairs(pairs, count, adjacency, arena);
+    }
+}
+
+const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+double monotonic_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+double stats_clock(void) {
+    return monotonic_seconds() - run_stats->origin;
+}
+
+void stats_add_bytes(uint64_t bytes) {
+    if (run_stats) {
+        atomic_fetch_add(&run_stats->bytes_written, bytes);
+    }
+}
+
+RunStats *stats_create(int M, int R) {
+    size_t size = sizeof(RunStats) + M * sizeof(MapperStats) + R * sizeof(ReducerStats);
+    RunStats *stats = (RunStats *)map_anonymous(size);
+    stats->origin = monotonic_seconds();
+    stats->M = M;
+    stats->R = R;
+    stats->mappers = (MapperStats *)(stats + 1);
+    stats->reducers = (ReducerStats *)(stats->mappers + M);
+    return stats;
+}
+
+void stats_destroy(RunStats *stats) {
+    munmap(stats, sizeof(RunStats) + stats->M * sizeof(MapperStats) + stats->R * sizeof(ReducerStats));
+}
+
+long peak_rss_kb(void) {
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    long peak = self.ru_maxrss > children.ru_maxrss ? self.ru_maxrss : children.ru_maxrss;
+#ifdef __APPLE__
+    peak /= 1024;
+#endif
+    return peak;
+}
+
+int parse_stats_format(const char *name) {
+    if (strcmp(name, "json") == 0) return STATS_JSON;
+    if (strcmp(name, "csv") == 0) return STATS_CSV;
+    fprintf(stderr, "Unknown stats format: %s\n", name);
+    exit(1);
+}
+
+// Map and reduce run from the first worker start to the last worker end;
+// with a pipelined shuffle the two spans overlap.
+void write_stats(const char *path, const char *program) {
+    RunStats *stats = run_stats;
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Error creating stats file");
+        exit(1);
+    }
+    
+    double map_start = stats->mappers[0].start, map_end = stats->mappers[0].end;
+    for (int i = 1; i < stats->M; i++) {
+        if (stats->mappers[i].start < map_start) map_start = stats->mappers[i].start;
+        if (stats->mappers[i].end > map_end) map_end = stats->mappers[i].end;
+    }
+    double reduce_start = stats->reducers[0].start, reduce_end = stats->reducers[0].end;
+    for (int i = 1; i < stats->R; i++) {
+        if (stats->reducers[i].start < reduce_start) reduce_start = stats->reducers[i].start;
+        if (stats->reducers[i].end > reduce_end) reduce_end = stats->reducers[i].end;
+    }
+    
+    const char *phase_names[] = {"load", "map", "reduce", "merge", "total"};
+    double phases[] = {
+        stats->load_end,
+        map_end - map_start,
+        reduce_end - reduce_start,
+        stats->merge_end - stats->shuffle_end,
+        stats->merge_end,
+    };
+    uint64_t bytes_written = atomic_load(&stats->bytes_written);
+    long peak_rss = peak_rss_kb();
+    
+    if (options.stats_format == STATS_CSV) {
+        fprintf(file, "scope,id,metric,value\n");
+        for (int i = 0; i < 5; i++) {
+            fprintf(file, "phase,,%s,%.6f\n", phase_names[i], phases[i]);
+        }
+        fprintf(file, "run,,bytes_written,%llu\n", (unsigned long long)bytes_written);
+        fprintf(file, "run,,peak_rss_kb,%ld\n", peak_rss);
+        for (int i = 0; i < stats->M; i++) {
+            MapperStats *mapper = &stats->mappers[i];
+            fprintf(file, "mapper,%d,start,%.6f\nmapper,%d,end,%.6f\n", i + 1, mapper->start, i + 1, mapper->end);
+            fprintf(file, "mapper,%d,edges_parsed,%llu\n", i + 1, (unsigned long long)mapper->edges_parsed);
+            fprintf(file, "mapper,%d,edges_filtered,%llu\n", i + 1, (unsigned long long)mapper->edges_filtered);
+            fprintf(file, "mapper,%d,pairs_emitted,%llu\n", i + 1, (unsigned long long)mapper->pairs_emitted);
+        }
+        for (int i = 0; i < stats->R; i++) {
+            ReducerStats *reducer = &stats->reducers[i];
+            fprintf(file, "reducer,%d,start,%.6f\nreducer,%d,ingest_end,%.6f\n", i + 1, reducer->start, i + 1, reducer->ingest_end);
+            fprintf(file, "reducer,%d,group_end,%.6f\nreducer,%d,end,%.6f\n", i + 1, reducer->group_end, i + 1, reducer->end);
+            fprintf(file, "reducer,%d,pairs_received,%llu\n", i + 1, (unsigned long long)reducer->pairs_received);
+            fprintf(file, "reducer,%d,dests,%llu\n", i + 1, (unsigned long long)reducer->dests);
+            fprintf(file, "reducer,%d,sources,%llu\n", i + 1, (unsigned long long)reducer->sources);
+            fprintf(file, "reducer,%d,spill_runs,%d\n", i + 1, reducer->spill_runs);
+        }
+    } else {
+        fprintf(file, "{\n  \"program\": \"%s\",\n  \"M\": %d,\n  \"R\": %d,\n  \"phases\": {", program, stats->M, stats->R);
+        for (int i = 0; i < 5; i++) {
+            fprintf(file, "%s\"%s\": %.6f", i ? ", " : "", phase_names[i], phases[i]);
+        }
+        fprintf(file, "},\n  \"bytes_written\": %llu,\n  \"peak_rss_kb\": %ld,\n  \"mappers\": [",
+                (unsigned long long)bytes_written, peak_rss);
+        for (int i = 0; i < stats->M; i++) {
+            MapperStats *mapper = &stats->mappers[i];
+            fprintf(file, "%s\n    {\"id\": %d, \"start\": %.6f, \"end\": %.6f, \"edges_parsed\": %llu, "
+                    "\"edges_filtered\": %llu, \"pairs_emitted\": %llu}",
+                    i ? "," : "", i + 1, mapper->start, mapper->end, (unsigned long long)mapper->edges_parsed,
+                    (unsigned long long)mapper->edges_filtered, (unsigned long long)mapper->pairs_emitted);
+        }
+        fprintf(file, "\n  ],\n  \"reducers\": [");
+        for (int i = 0; i < stats->R; i++) {
+            ReducerStats *reducer = &stats->reducers[i];
+            fprintf(file, "%s\n    {\"id\": %d, \"start\": %.6f, \"ingest_end\": %.6f, \"group_end\": %.6f, \"end\": %.6f, "
+                    "\"pairs_received\": %llu, \"dests\": %llu, \"sources\": %llu, \"spill_runs\": %d}",
+                    i ? "," : "", i + 1, reducer->start, reducer->ingest_end, reducer->group_end, reducer->end,
+                    (unsigned long long)reducer->pairs_received, (unsigned long long)reducer->dests,
+                    (unsigned long long)reducer->sources, reducer->spill_runs);
+        }
+        fprintf(file, "\n  ]\n}\n");
+    }
+    
+    fclose(file);
+}
+
+// Only regular files take positioned writes, so only they get more than one
+// buffer, and only with an asynchronous --io backend.
+void output_open_sized(OutputBuffer *out, const char *name, size_t capacity, int depth) {
+    out->direct = 0;
+    out->fd = -1;
+#ifdef O_DIRECT
+    if (options.direct_output) {
+        out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        out->direct = (out->fd >= 0);
+    }
+#endif
+    if (out->fd < 0) {
+        out->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (out->fd < 0) {
+        perror(name);
+        exit(1);
+    }
+    
+    struct stat st;
+    out->offset = -1;
+    out->depth = 1;
+    if (fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        out->offset = 0;
+        if (options.io_backend != IO_SYNC && depth > 1) out->depth = depth;
+    }
+    
+    out->length = 0;
+    out->capacity = capacity;
+    out->current = 0;
+    out->buffers = calloc(out->depth, sizeof(char *));
+    out->requests = calloc(out->depth, sizeof(IoRequest));
+    if (posix_memalign((void **)&out->buffers[0], OUTPUT_ALIGNMENT, out->capacity) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    out->data = out->buffers[0];
+}
+
+void output_open(OutputBuffer *out, const char *name) {
+    output_open_sized(out, name, OUTPUT_BUFFER_SIZE, options.io_depth);
+}
+
+void output_write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+void output_write_at(OutputBuffer *out, const char *data, size_t length) {
+    if (out->offset < 0) {
+        output_write_all(out->fd, data, length);
+        return;
+    }
+    while (length > 0) {
+        ssize_t written = pwrite(out->fd, data, length, (off_t)out->offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            perror("write");
+            exit(1);
+        }
+        data += written;
+        length -= (size_t)written;
+        out->offset += written;
+    }
+}
+
+// O_DIRECT only accepts whole aligned blocks, so a direct flush keeps the
+// unaligned tail in the buffer for the next flush or for output_close. With
+// more than one buffer the write is only submitted, and the tail moves on
+// to the next buffer once that one's own write has completed.
+void output_flush(OutputBuffer *out) {
+    size_t length = out->length;
+    if (out->direct) {
+        length &= ~(size_t)(OUTPUT_ALIGNMENT - 1);
+    }
+    stats_add_bytes(length);
+    if (out->depth == 1) {
+        output_write_at(out, out->data, length);
+        memmove(out->data, out->data + length, out->length - length);
+        out->length -= length;
+        return;
+    }
+    if (length == 0) return;
+    
+    io_submit(&out->requests[out->current], IO_WRITE, out->fd, out->data, length, out->offset);
+    out->offset += length;
+    char *tail = out->data + length;
+    size_t tail_length = out->length - length;
+    
+    out->current = (out->current + 1) % out->depth;
+    io_wait(&out->requests[out->current]);
+    if (!out->buffers[out->current] &&
+        posix_memalign((void **)&out->buffers[out->current], OUTPUT_ALIGNMENT, out->capacity) != 0) {
+        perror("posix_memalign");
+        exit(1);
+    }
+    out->data = out->buffers[out->current];
+    memcpy(out->data, tail, tail_length);
+    out->length = tail_length;
+}
+
+char *output_reserve(OutputBuffer *out, size_t needed) {
+    if (out->capacity - out->length < needed) {
+        output_flush(out);
+    }
+    return out->data + out->length;
+}
+
+void output_bytes(OutputBuffer *out, const char *data, size_t length) {
+    while (length > 0) {
+        size_t room = out->capacity - out->length;
+        if (room == 0) {
+            output_flush(out);
+            room = out->capacity - out->length;
+        }
+        size_t chunk = length < room ? length : room;
+        memcpy(out->data + out->length, data, chunk);
+        out->length += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+// Writes the decimal form of value two digits at a time from the pair table.
+// Returns the number of bytes written; p needs room for 11.
+size_t format_int(char *p, int value) {
+    char digits[12];
+    char *end = digits + sizeof(digits);
+    char *q = end;
+    size_t length = 0;
+    uint32_t magnitude = (uint32_t)value;
+    
+    if (value < 0) {
+        *p = '-';
+        length = 1;
+        magnitude = 0u - magnitude;
+    }
+    while (magnitude >= 100) {
+        uint32_t pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        q -= 2;
+        q[0] = digit_pairs[pair];
+        q[1] = digit_pairs[pair + 1];
+    }
+    if (magnitude >= 10) {
+        q -= 2;
+        q[0] = digit_pairs[magnitude * 2];
+        q[1] = digit_pairs[magnitude * 2 + 1];
+    } else {
+        *--q = (char)('0' + magnitude);
+    }
+    
+    memcpy(p + length, q, (size_t)(end - q));
+    return length + (size_t)(end - q);
+}
+
+// Appends prefix, then value, then suffix (each separator may be 0 for none).
+void output_int(OutputBuffer *out, char prefix, int value, char suffix) {
+    char *p = output_reserve(out, 13);
+    size_t length = 0;
+    if (prefix) p[length++] = prefix;
+    length += format_int(p + length, value);
+    if (suffix) p[length++] = suffix;
+    out->length += length;
+}
+
+void output_close(OutputBuffer *out) {
+    output_flush(out);
+    for (int i = 0; i < out->depth; i++) {
+        io_wait(&out->requests[i]);
+    }
+#ifdef O_DIRECT
+    if (out->direct && out->length > 0) {
+        fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+        output_write_at(out, out->data, out->length);
+        stats_add_bytes(out->length);
+        out->length = 0;
+    }
+#endif
+    if (close(out->fd) != 0) {
+        perror("close");
+        exit(1);
+    }
+    for (int i = 0; i < out->depth; i++) {
+        free(out->buffers[i]);
+    }
+    free(out->buffers);
+    free(out->requests);
+    out->data = NULL;
+}
+
+void write_adjacency(OutputBuffer *out, const Adjacency *adjacency) {
+    for (int i = 0; i < adjacency->dest_count; i++) {
+        output_int(out, 0, adjacency->dests[i], ':');
+        for (int j = adjacency->offsets[i]; j < adjacency->offsets[i + 1]; j++) {
+            output_int(out, ' ', adjacency->sources[j], 0);
+        }
+        output_bytes(out, "\n", 1);
+    }
+}
+
+// Picks the smallest precision whose standard error, 1.04 / sqrt(2^p),
+// stays within error.
+int sketch_precision(double error) {
+    int precision = SKETCH_MIN_PRECISION;
+    while (precision < SKETCH_MAX_PRECISION && 1.04 / sqrt((double)(1 << precision)) > error) {
+        precision++;
+    }
+    return precision;
+}
+
+void sketch_set_register(Sketch *sketch, uint64_t hash) {
+    int precision = options.sketch_precision;
+    uint64_t rest = hash << precision;
+    int rank = rest ? __builtin_clzll(rest) + 1 : 64 - precision + 1;
+    unsigned index = (unsigned)(hash >> (64 - precision));
+    if (rank > sketch->registers[index]) {
+        sketch->registers[index] = (unsigned char)rank;
+    }
+}
+
+void sketch_make_dense(Sketch *sketch, Arena *arena) {
+    size_t register_count = (size_t)1 << options.sketch_precision;
+    sketch->registers = arena_alloc(arena, register_count);
+    memset(sketch->registers, 0, register_count);
+    for (int i = 0; i < sketch->capacity; i++) {
+        if (sketch->hashes[i]) sketch_set_register(sketch, sketch->hashes[i]);
+    }
+    sketch->hashes = NULL;
+    sketch->capacity = 0;
+    sketch->count = -1;
+}
+
+// Hash 0 marks an empty sparse slot, so it is folded onto 1.
+void sketch_add_hash(Sketch *sketch, uint64_t hash, Arena *arena) {
+    if (hash == 0) hash = 1;
+    if (sketch->count < 0) {
+        sketch_set_register(sketch, hash);
+        return;
+    }
+    
+    if (2 * (sketch->count + 1) > sketch->capacity) {
+        if (sketch->count + 1 > options.sketch_sparse_limit) {
+            sketch_make_dense(sketch, arena);
+            sketch_set_register(sketch, hash);
+            return;
+        }
+        
+        uint64_t *old_hashes = sketch->hashes;
+        int old_capacity = sketch->capacity;
+        sketch->capacity = old_capacity ? old_capacity * 2 : SKETCH_SPARSE_INITIAL;
+        sketch->hashes = arena_alloc(arena, sketch->capacity * sizeof(uint64_t));
+        memset(sketch->hashes, 0, sketch->capacity * sizeof(uint64_t));
+        sketch->count = 0;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_hashes[i]) sketch_add_hash(sketch, old_hashes[i], arena);
+        }
+    }
+    
+    size_t mask = sketch->capacity - 1;
+    size_t slot = hash & mask;
+    while (sketch->hashes[slot] && sketch->hashes[slot] != hash) {
+        slot = (slot + 1) & mask;
+    }
+    if (!sketch->hashes[slot]) {
+        sketch->hashes[slot] = hash;
+        sketch->count++;
+    }
+}
+
+uint64_t sketch_estimate(const Sketch *sketch) {
+    if (sketch->count >= 0) return (uint64_t)sketch->count;
+    
+    int register_count = 1 << options.sketch_precision;
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < register_count; i++) {
+        sum += ldexp(1.0, -sketch->registers[i]);
+        zeros += (sketch->registers[i] == 0);
+    }
+    
+    double alpha = 0.7213 / (1 + 1.079 / register_count);
+    double estimate = alpha * register_count * (double)register_count / sum;
+    if (estimate <= 2.5 * register_count && zeros > 0) {
+        estimate = register_count * log((double)register_count / zeros);
+    }
+    return (uint64_t)(estimate + 0.5);
+}
+
+void sketch_table_free(SketchTable *table) {
+    free(table->sketches);
+    free(table->slots);
+    arena_free(&table->arena);
+}
+
+void sketch_table_grow(SketchTable *table) {
+    size_t capacity = table->slot_capacity ? table->slot_capacity * 2 : 1024;
+    free(table->slots);
+    table->slots = calloc(capacity, sizeof(int));
+    table->slot_capacity = capacity;
+    for (int i = 0; i < table->count; i++) {
+        size_t slot = mix_hash((uint32_t)table->sketches[i].dest) & (capacity - 1);
+        while (table->slots[slot]) slot = (slot + 1) & (capacity - 1);
+        table->slots[slot] = i + 1;
+    }
+}
+
+Sketch *sketch_table_find(SketchTable *table, int dest) {
+    if (2 * (size_t)(table->count + 1) > table->slot_capacity) {
+        sketch_table_grow(table);
+    }
+    
+    size_t mask = table->slot_capacity - 1;
+    size_t slot = mix_hash((uint32_t)dest) & mask;
+    while (table->slots[slot] && table->sketches[table->slots[slot] - 1].dest != dest) {
+        slot = (slot + 1) & mask;
+    }
+    if (table->slots[slot]) {
+        return &table->sketches[table->slots[slot] - 1];
+    }
+    
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 1024;
+        table->sketches = realloc(table->sketches, table->capacity * sizeof(Sketch));
+    }
+    Sketch *sketch = &table->sketches[table->count];
+    memset(sketch, 0, sizeof(Sketch));
+    sketch->dest = dest;
+    table->slots[slot] = ++table->count;
+    return sketch;
+}
+
+void sketch_table_add(SketchTable *table, int dest, int source) {
+    Sketch *sketch = sketch_table_find(table, dest);
+    sketch_add_hash(sketch, mix_hash((uint32_t)source), &table->arena);
+}
+
+// A sketch file is a run of records: int32 dest, int32 count, then count
+// uint64 sparse hashes, or 2^precision registers when count is -1.
+void write_sketch_file(SketchTable *table, const char *name) {
+    OutputBuffer out;
+    output_open(&out, name);
+    size_t register_count = (size_t)1 << options.sketch_precision;
+    
+    for (int i = 0; i < table->count; i++) {
+        Sketch *sketch = &table->sketches[i];
+        output_bytes(&out, (const char *)&sketch->dest, sizeof(int));
+        output_bytes(&out, (const char *)&sketch->count, sizeof(int));
+        if (sketch->count < 0) {
+            output_bytes(&out, (const char *)sketch->registers, register_count);
+            continue;
+        }
+        for (int j = 0; j < sketch->capacity; j++) {
+            if (sketch->hashes[j]) {
+                output_bytes(&out, (const char *)&sketch->hashes[j], sizeof(uint64_t));
+            }
+        }
+    }
+    
+    output_close(&out);
+}
+
+// Merges every mapper's sketch-M-N file for this reducer into table.
+void read_sketch_files(int reducer_id, int M, SketchTable *table) {
+    size_t register_count = (size_t)1 << options.sketch_precision;
+    
+    for (int i = 1; i <= M; i++) {
+        char sketch_name[64];
+        sprintf(sketch_name, "sketch-%d-%d", i, reducer_id);
+        size_t size;
+        char *data = map_input_file(sketch_name, &size);
+        size_t offset = 0;
+        
+        while (offset + 2 * sizeof(int) <= size) {
+            int dest, count;
+            memcpy(&dest, data + offset, sizeof(int));
+            memcpy(&count, data + offset + sizeof(int), sizeof(int));
+            offset += 2 * sizeof(int);
+            
+            Sketch *sketch = sketch_table_find(table, dest);
+            if (count < 0) {
+                if (sketch->count >= 0) sketch_make_dense(sketch, &table->arena);
+                const unsigned char *registers = (const unsigned char *)data + offset;
+                for (size_t j = 0; j < register_count; j++) {
+                    if (registers[j] > sketch->registers[j]) sketch->registers[j] = registers[j];
+                }
+                offset += register_count;
+            } else {
+                for (int j = 0; j < count; j++) {
+                    uint64_t hash;
+                    memcpy(&hash, data + offset + j * sizeof(uint64_t), sizeof(uint64_t));
+                    sketch_add_hash(sketch, hash, &table->arena);
+                }
+                offset += count * sizeof(uint64_t);
+            }
+        }
+        unmap_file(data, size);
+        unlink(sketch_name);
+    }
+}
+
+// Lays the estimates out as a counts-only adjacency in ascending dest order,
+// the shape the exact reducers publish.
+void estimate_adjacency(SketchTable *table, Adjacency *adjacency, Arena *arena) {
+    int count = table->count;
+    uint64_t *order = arena_alloc(arena, count * sizeof(uint64_t));
+    uint64_t *scratch = arena_alloc(arena, count * sizeof(uint64_t));
+    for (int i = 0; i < count; i++) {
+        order[i] = ((uint64_t)((uint32_t)table->sketches[i].dest ^ SIGN_FLIP) << 32) | (uint32_t)i;
+    }
+    radix_sort_keys(order, scratch, count, 32);
+    
+    adjacency->dests = arena_alloc(arena, count * sizeof(int));
+    adjacency->offsets = arena_alloc(arena, (count + 1) * sizeof(int));
+    adjacency->sources = NULL;
+    adjacency->dest_count = count;
+    
+    int offset = 0;
+    for (int r = 0; r < count; r++) {
+        Sketch *sketch = &table->sketches[(uint32_t)order[r]];
+        adjacency->dests[r] = sketch->dest;
+        adjacency->offsets[r] = offset;
+        offset += (int)sketch_estimate(sketch);
+    }
+    adjacency->offsets[count] = offset;
+}
+
+int parse_sketch_error(const char *text) {
+    char *end;
+    double error = strtod(text, &end);
+    if (end == text || *end != '\0' || error <= 0 || error >= 1) {
+        fprintf(stderr, "Invalid sketch error bound: %s\n", text);
+        exit(1);
+    }
+    return sketch_precision(error);
+}
+
+int parse_reducer_mode(const char *name) {
+    if (strcmp(name, "sort") == 0) return REDUCER_SORT;
+    if (strcmp(name, "hash") == 0) return REDUCER_HASH;
+    fprintf(stderr, "Unknown reducer mode: %s\n", name);
+    exit(1);
+}
+
+int run_less(const RunCursor *a, const RunCursor *b) {
+    return pair_key(&a->pairs[a->position]) < pair_key(&b->pairs[b->position]);
+}
+
+void run_sift_down(RunCursor **heap, int heap_size, int index) {
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1;
+        int right = 2 * index + 2;
+        
+        if (left < heap_size && run_less(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_size && run_less(heap[right], heap[smallest])) smallest = right;
+        if (smallest == index) break;
+        
+        RunCursor *temp = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = temp;
+        index = smallest;
+    }
+}
+
+// Merges run_count sorted runs of pairs, delimited by run_starts (run_count + 1
+// entries), into out.
+void merge_runs(const Pair *pairs, const int *run_starts, int run_count, Pair *out) {
+    RunCursor *cursors = malloc(run_count * sizeof(RunCursor));
+    RunCursor **heap = malloc(run_count * sizeof(RunCursor *));
+    int heap_size = 0;
+    
+    for (int i = 0; i < run_count; i++) {
+        cursors[i].pairs = pairs;
+        cursors[i].position = run_starts[i];
+        cursors[i].end = run_starts[i + 1];
+        if (cursors[i].position < cursors[i].end) {
+            heap[heap_size++] = &cursors[i];
+        }
+    }
+    
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        run_sift_down(heap, heap_size, i);
+    }
+    
+    int written = 0;
+    while (heap_size > 0) {
+        RunCursor *top = heap[0];
+        out[written++] = top->pairs[top->position++];
+        if (top->position == top->end) {
+            heap[0] = heap[--heap_size];
+        }
+        run_sift_down(heap, heap_size, 0);
+    }
+    
+    free(cursors);
+    free(heap);
+}
+
+// Heap-merges sorted runs of pairs, visiting each distinct pair once.
+void merge_unique_runs(RunCursor *cursors, int run_count, PairVisitor visit, void *context) {
+    RunCursor **heap = malloc((run_count > 0 ? run_count : 1) * sizeof(RunCursor *));
+    int heap_size = 0;
+    
+    for (int i = 0; i < run_count; i++) {
+        if (cursors[i].position < cursors[i].end) {
+            heap[heap_size++] = &cursors[i];
+        }
+    }
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        run_sift_down(heap, heap_size, i);
+    }
+    
+    Pair last = {0, 0};
+    int has_last = 0;
+    while (heap_size > 0) {
+        RunCursor *top = heap[0];
+        const Pair *pair = &top->pairs[top->position++];
+        if (!has_last || pair->dest != last.dest || pair->source != last.source) {
+            visit(pair, context);
+            last = *pair;
+            has_last = 1;
+        }
+        if (top->position == top->end) {
+            heap[0] = heap[--heap_size];
+        }
+        run_sift_down(heap, heap_size, 0);
+    }
+    free(heap);
+}
+
+void write_spill_pair(const Pair *pair, void *context) {
+    output_bytes(context, (const char *)pair, sizeof(Pair));
+}
+
+// Writes the reducer's sorted in-memory runs out as one deduplicated run
+// file, so a spilling reducer never buffers much more than spill_pairs.
+void spill_sorted_runs(SpillRuns *spill, const Pair *pairs, const int *run_starts, int run_count) {
+    RunCursor *cursors = malloc(run_count * sizeof(RunCursor));
+    for (int i = 0; i < run_count; i++) {
+        cursors[i].pairs = pairs;
+        cursors[i].position = run_starts[i];
+        cursors[i].end = run_starts[i + 1];
+    }
+    
+    char spill_name[64];
+    sprintf(spill_name, "spill-%d-%d", spill->reducer_id, ++spill->run_count);
+    spill->pairs += run_starts[run_count] - run_starts[0];
+    OutputBuffer output;
+    output_open(&output, spill_name);
+    merge_unique_runs(cursors, run_count, write_spill_pair, &output);
+    output_close(&output);
+    
+    free(cursors);
+}
+
+// Sorts the reducer's buffered pairs as a single run and spills it.
+void spill_pair_buffer(SpillRuns *spill, PairBuffer *pairs, Arena *arena) {
+    if (spill->keys == NULL) {
+        spill->keys = arena_alloc(arena, options.spill_pairs * sizeof(uint64_t));
+        spill->scratch = arena_alloc(arena, options.spill_pairs * sizeof(uint64_t));
+    }
+    int run_starts[2] = {0, pairs->count};
+    sort_pairs_with_scratch(pairs->pairs, pairs->count, spill->keys, spill->scratch);
+    spill_sorted_runs(spill, pairs->pairs, run_starts, 1);
+    pairs->count = 0;
+}
+
+void flush_streamed_dest(StreamedAdjacencyWriter *writer) {
+    if (writer->current.count == 0) return;
+    output_bytes(&writer->counts, (const char *)&writer->current, sizeof(DestCount));
+    if (options.reducer_outputs) {
+        output_bytes(&writer->text, "\n", 1);
+    }
+}
+
+void write_streamed_pair(const Pair *pair, void *context) {
+    StreamedAdjacencyWriter *writer = context;
+    
+    if (writer->current.count == 0 || pair->dest != writer->current.destination) {
+        flush_streamed_dest(writer);
+        writer->current.destination = pair->dest;
+        writer->current.count = 0;
+        writer->dest_total++;
+        if (options.reducer_outputs) {
+            output_int(&writer->text, 0, pair->dest, ':');
+        }
+    }
+    
+    writer->current.count++;
+    writer->source_total++;
+    if (!options.counts_only) {
+        output_bytes(&writer->sources, (const char *)&pair->source, sizeof(int));
+    }
+    if (options.reducer_outputs) {
+        output_int(&writer->text, ' ', pair->source, 0);
+    }
+}
+
+// Merges the reducer's spill runs into counts-N and sources-N, the on-disk
+// form of the (dest, count) entries and sources it would otherwise publish
+// from memory, and removes the runs.
+void merge_spilled_runs(SpillRuns *spill) {
+    int run_count = spill->run_count;
+    RunCursor *cursors = malloc(run_count * sizeof(RunCursor));
+    char **run_data = malloc(run_count * sizeof(char *));
+    size_t *run_sizes = malloc(run_count * sizeof(size_t));
+    char name[64];
+    
+    for (int i = 0; i < run_count; i++) {
+        sprintf(name, "spill-%d-%d", spill->reducer_id, i + 1);
+        run_data[i] = map_input_file(name, &run_sizes[i]);
+        cursors[i].pairs = (const Pair *)run_data[i];
+        cursors[i].position = 0;
+        cursors[i].end = (int)(run_sizes[i] / sizeof(Pair));
+    }
+    
+    StreamedAdjacencyWriter writer;
+    memset(&writer.current, 0, sizeof(writer.current));
+    writer.dest_total = 0;
+    writer.source_total = 0;
+    sprintf(name, "counts-%d", spill->reducer_id);
+    output_open(&writer.counts, name);
+    if (!options.counts_only) {
+        sprintf(name, "sources-%d", spill->reducer_id);
+        output_open(&writer.sources, name);
+    }
+    if (options.reducer_outputs) {
+        sprintf(name, "output-%d", spill->reducer_id);
+        output_open(&writer.text, name);
+    }
+    
+    merge_unique_runs(cursors, run_count, write_streamed_pair, &writer);
+    flush_streamed_dest(&writer);
+    spill->dests = writer.dest_total;
+    spill->sources = writer.source_total;
+    
+    output_close(&writer.counts);
+    if (!options.counts_only) {
+        output_close(&writer.sources);
+    }
+    if (options.reducer_outputs) {
+        output_close(&writer.text);
+    }
+    
+    for (int i = 0; i < run_count; i++) {
+        unmap_file(run_data[i], run_sizes[i]);
+        sprintf(name, "spill-%d-%d", spill->reducer_id, i + 1);
+        unlink(name);
+    }
+    free(run_data);
+    free(run_sizes);
+    free(cursors);
+}
+
+void map_streamed_adjacency(int reducer_id, AdjacencyCursor *cursor, StreamedAdjacency *mapping) {
+    char name[64];
+    sprintf(name, "counts-%d", reducer_id);
+    mapping->counts = map_input_file(name, &mapping->counts_size);
+    mapping->sources = NULL;
+    mapping->sources_size = 0;
+    if (!options.counts_only) {
+        sprintf(name, "sources-%d", reducer_id);
+        mapping->sources = map_input_file(name, &mapping->sources_size);
+    }
+    mapping->mapped = 1;
+    
+    cursor->counts = (const DestCount *)mapping->counts;
+    cursor->sources = (const int *)mapping->sources;
+    cursor->count = (int)(mapping->counts_size / sizeof(DestCount));
+}
+
+void release_streamed_adjacency(int reducer_id, StreamedAdjacency *mapping) {
+    char name[64];
+    unmap_file(mapping->counts, mapping->counts_size);
+    unmap_file(mapping->sources, mapping->sources_size);
+    sprintf(name, "counts-%d", reducer_id);
+    unlink(name);
+    if (mapping->sources) {
+        sprintf(name, "sources-%d", reducer_id);
+        unlink(name);
+    }
+    mapping->mapped = 0;
+}
+
+// A pipe cannot be checked for compression before it is read, so the stream
+// reader looks at its first bytes: gzip (and so BGZF) input is inflated as it
+// arrives, member after member, and anything else is passed through as is.
+typedef struct {
+    int fd;
+    int gzip;
+    int eof;
+    int finished;
+    unsigned char *input;
+    z_stream stream;
+} InputStream;
+
+// One read of fd; returns 0 at its end.
+size_t read_input(int fd, void *buffer, size_t length) {
+    while (1) {
+        ssize_t n = read(fd, buffer, length);
+        if (n >= 0) return (size_t)n;
+        if (errno != EINTR) {
+            perror("Error reading input stream");
+            exit(1);
+        }
+    }
+}
+
+// Reads more of fd until at least wanted unconsumed bytes are buffered or
+// the input ends.
+void input_stream_fill(InputStream *input, size_t wanted) {
+    memmove(input->input, input->stream.next_in, input->stream.avail_in);
+    input->stream.next_in = input->input;
+    while (input->stream.avail_in < wanted && !input->eof) {
+        size_t n = read_input(input->fd, input->input + input->stream.avail_in,
+                              STREAM_INPUT_SIZE - input->stream.avail_in);
+        if (n == 0) input->eof = 1;
+        input->stream.avail_in += (uInt)n;
+    }
+}
+
+void input_stream_open(InputStream *input, int fd) {
+    memset(input, 0, sizeof(*input));
+    input->fd = fd;
+    input->input = malloc(STREAM_INPUT_SIZE);
+    input->stream.next_in = input->input;
+    input_stream_fill(input, 18);
+    input->gzip = is_gzip((const char *)input->input, input->stream.avail_in);
+    if (input->gzip && inflateInit2(&input->stream, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "inflateInit2 failed\n");
+        exit(1);
+    }
+}
+
+void input_stream_close(InputStream *input) {
+    if (input->gzip) inflateEnd(&input->stream);
+    free(input->input);
+}
+
+// Reads up to room bytes of (inflated) input into out; returns 0 at the end.
+size_t input_stream_read(InputStream *input, char *out, size_t room) {
+    if (!input->gzip) {
+        if (input->stream.avail_in == 0) return read_input(input->fd, out, room);
+        size_t n = input->stream.avail_in < room ? input->stream.avail_in : room;
+        memcpy(out, input->stream.next_in, n);
+        input->stream.next_in += n;
+        input->stream.avail_in -= (uInt)n;
+        return n;
+    }
+    
+    while (!input->finished) {
+        if (input->stream.avail_in == 0) input_stream_fill(input, 1);
+        input->stream.next_out = (Bytef *)out;
+        input->stream.avail_out = (uInt)(room < UINT_MAX ? room : UINT_MAX);
+        
+        int status = inflate(&input->stream, Z_NO_FLUSH);
+        size_t produced = (size_t)((char *)input->stream.next_out - out);
+        if (status == Z_STREAM_END) {
+            // Another member may follow, as in BGZF; anything else ends the input.
+            input_stream_fill(input, 18);
+            if (is_gzip((const char *)input->stream.next_in, input->stream.avail_in)) {
+                inflateReset(&input->stream);
+            } else {
+                input->finished = 1;
+            }
+        } else if (status != Z_OK && status != Z_BUF_ERROR) {
+            fprintf(stderr, "Corrupt gzip input\n");
+            exit(1);
+        } else if (produced == 0 && input->stream.avail_in == 0 && input->eof) {
+            fprintf(stderr, "Truncated gzip input\n");
+            exit(1);
+        }
+        if (produced > 0) return produced;
+    }
+    return 0;
+}
+
+// Reads fd to EOF and hands it to deliver in chunks of about
+// STREAM_CHUNK_SIZE, each cut after its last newline so that no edge is
+// split between chunks. Compressed input is inflated first. deliver takes
+// ownership of the malloc'd chunk.
+void read_stream_chunks(int fd, ChunkHandler deliver, void *context) {
+    InputStream input;
+    input_stream_open(&input, fd);
+    size_t capacity = STREAM_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    size_t length = 0;
+    int eof = 0;
+    
+    while (!eof) {
+        while (length < capacity) {
+            size_t n = input_stream_read(&input, buffer + length, capacity - length);
+            if (n == 0) {
+                eof = 1;
+                break;
+            }
+            length += n;
+        }
+        
+        size_t cut = length;
+        if (!eof) {
+            while (cut > 0 && buffer[cut - 1] != '\n') cut--;
+            if (cut == 0) {
+                capacity *= 2;
+                buffer = realloc(buffer, capacity);
+                continue;
+            }
+        }
+        
+        size_t tail = length - cut;
+        size_t next_capacity = tail * 2 > STREAM_CHUNK_SIZE ? tail * 2 : STREAM_CHUNK_SIZE;
+        char *next = malloc(next_capacity);
+        memcpy(next, buffer + cut, tail);
+        if (cut > 0) {
+            deliver(buffer, cut, context);
+        } else {
+            free(buffer);
+        }
+        buffer = next;
+        capacity = next_capacity;
+        length = tail;
+    }
+    free(buffer);
+    input_stream_close(&input);
+}
+
+void futex_wait(_Atomic uint32_t *address, uint32_t expected) {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)address, FUTEX_WAIT, expected, NULL, NULL, 0);
+#else
+    (void)address;
+    (void)expected;
+    sched_yield();
+#endif
+}
+
+void futex_wake(_Atomic uint32_t *address) {
+#ifdef __linux__
+    syscall(SYS_futex, (uint32_t *)address, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+    (void)address;
+#endif
+}
+
+// Splits a 2^SHMSIZE shared-memory object into one doorbell per reducer and
+// M * R single-producer/single-consumer rings, each with the largest
+// power-of-two capacity that fits its share.
+void shuffle_region_create(ShuffleRegion *region, int M, int R, size_t size) {
+    size_t header_size = (R * sizeof(ShmDoorbell) + 63) & ~(size_t)63;
+    size_t share = size > header_size ? (size - header_size) / (M * R) : 0;
+    
+    uint32_t capacity = 1;
+    while (sizeof(ShmRing) + (size_t)capacity * 2 * sizeof(Pair) <= share && capacity < (1u << 30)) {
+        capacity *= 2;
+    }
+    if (sizeof(ShmRing) + (size_t)capacity * sizeof(Pair) > share || capacity < SHM_RING_MIN_CAPACITY) {
+        fprintf(stderr, "SHMSIZE too small for %d x %d shuffle rings\n", M, R);
+        exit(1);
+    }
+    
+    int fd = shm_open(SHUFFLE_SHM_NAME, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(1);
+    }
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    
+    region->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region->base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    memset(region->base, 0, header_size + (size_t)M * R * ((sizeof(ShmRing) + capacity * sizeof(Pair) + 63) & ~(size_t)63));
+    
+    region->size = size;
+    region->R = R;
+    region->capacity = capacity;
+    region->header_size = header_size;
+    region->ring_stride = (sizeof(ShmRing) + capacity * sizeof(Pair) + 63) & ~(size_t)63;
+    region->doorbells = (ShmDoorbell *)region->base;
+}
+
+void shuffle_region_destroy(ShuffleRegion *region) {
+    if (munmap(region->base, region->size) == -1) {
+        perror("munmap");
+    }
+    if (shm_unlink(SHUFFLE_SHM_NAME) == -1) {
+        perror("shm_unlink");
+    }
+}
+
+ShmRing *shuffle_ring(ShuffleRegion *region, int mapper_index, int reducer_index) {
+    size_t index = (size_t)mapper_index * region->R + reducer_index;
+    return (ShmRing *)((char *)region->base + region->header_size + index * region->ring_stride);
+}
+
+Pair *ring_slots(ShmRing *ring) {
+    return (Pair *)(ring + 1);
+}
+
+void ring_doorbell(ShmDoorbell *doorbell) {
+    atomic_fetch_add(&doorbell->sequence, 1);
+    if (atomic_load(&doorbell->consumer_waiting)) {
+        futex_wake(&doorbell->sequence);
+    }
+}
+
+void shm_ring_push(ShmRing *ring, ShmDoorbell *doorbell, uint32_t capacity, const Pair *pairs, int count) {
+    Pair *slots = ring_slots(ring);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int written = 0;
+    
+    while (written < count) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t space = capacity - (tail - head);
+        
+        if (space == 0) {
+            atomic_store(&ring->producer_waiting, 1);
+            head = atomic_load(&ring->head);
+            if (capacity - (tail - head) == 0) {
+                futex_wait(&ring->head, head);
+            }
+            atomic_store(&ring->producer_waiting, 0);
+            continue;
+        }
+        
+        uint32_t n = (uint32_t)(count - written) < space ? (uint32_t)(count - written) : space;
+        for (uint32_t i = 0; i < n; i++) {
+            slots[(tail + i) & (capacity - 1)] = pairs[written + i];
+        }
+        tail += n;
+        written += n;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    
+    ring_doorbell(doorbell);
+}
+
+int shm_ring_pop(ShmRing *ring, uint32_t capacity, Pair *out, int max) {
+    Pair *slots = ring_slots(ring);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t n = tail - head < (uint32_t)max ? tail - head : (uint32_t)max;
+    
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = slots[(head + i) & (capacity - 1)];
+    }
+    // Sequentially consistent, like the producer's store of producer_waiting
+    // and its reload of head: either it sees this head or we see it waiting.
+    atomic_store(&ring->head, head + n);
+    
+    if (n > 0 && atomic_load(&ring->producer_waiting)) {
+        futex_wake(&ring->head);
+    }
+    return (int)n;
+}
+
+void shm_ring_close(ShmRing *ring, ShmDoorbell *doorbell) {
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+    ring_doorbell(doorbell);
+}
+
+int compare_ints(const void *a, const void *b) {
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+    return (ia > ib) - (ia < ib);
+}
+
+// Samples destinations at evenly spaced line starts of INFILE and returns the
+// R - 1 quantile boundaries; reducer i then owns the dests in
+// [boundaries[i - 1], boundaries[i]).
+int *build_range_boundaries(const char *data, size_t size, int R, int MIND, int MAXD) {
+    int *boundaries = malloc((R > 1 ? R - 1 : 1) * sizeof(int));
+    int *samples = malloc(PARTITION_SAMPLES * sizeof(int));
+    int sample_count = 0;
+    
+    for (int k = 0; k < PARTITION_SAMPLES && size > 0; k++) {
+        size_t offset = align_to_line(data, size, size / PARTITION_SAMPLES * k + size % PARTITION_SAMPLES * k / PARTITION_SAMPLES);
+        const char *cursor = data + offset;
+        int source, dest;
+        
+        if (!next_edge(&cursor, data + size, &source, &dest)) continue;
+        if (MIND != -1 && dest < MIND) continue;
+        if (MAXD != -1 && dest > MAXD) continue;
+        samples[sample_count++] = dest;
+    }
+    
+    qsort(samples, sample_count, sizeof(int), compare_ints);
+    
+    for (int i = 0; i < R - 1; i++) {
+        boundaries[i] = sample_count > 0 ? samples[(long)(i + 1) * sample_count / R] : INT_MAX;
+    }
+    
+    free(samples);
+    return boundaries;
+}
+
+RangeIndex *build_range_index(const char *data, size_t size) {
+    RangeIndex *index = calloc(1, sizeof(RangeIndex));
+    uint64_t capacity = size / INDEX_BLOCK_SIZE + 1;
+    index->blocks = malloc(capacity * sizeof(IndexBlock));
+    
+    uint64_t count = 0;
+    size_t offset = 0;
+    while (offset < size) {
+        size_t end = align_to_line(data, size, offset + INDEX_BLOCK_SIZE < size ? offset + INDEX_BLOCK_SIZE : size);
+        IndexBlock *block = &index->blocks[count++];
+        block->offset = offset;
+        block->min_dest = INT_MAX;
+        block->max_dest = INT_MIN;
+        
+        const char *cursor = data + offset;
+        int source, dest;
+        while (next_edge(&cursor, data + end, &source, &dest)) {
+            if (dest < block->min_dest) block->min_dest = dest;
+            if (dest > block->max_dest) block->max_dest = dest;
+        }
+        offset = end;
+    }
+    
+    memcpy(index->header.magic, RANGE_INDEX_MAGIC, sizeof(index->header.magic));
+    index->header.version = RANGE_INDEX_VERSION;
+    index->header.block_size = INDEX_BLOCK_SIZE;
+    index->header.input_size = size;
+    index->header.block_count = count;
+    return index;
+}
+
+void free_range_index(RangeIndex *index) {
+    if (!index) return;
+    free(index->blocks);
+    free(index);
+}
+
+// Returns the index stored at path if it still describes the input, or NULL
+// if it is missing, from another version or stale.
+RangeIndex *read_range_index(const char *path, const RangeIndexHeader *expected) {
+    FILE *file = fopen(path, "r");
+    if (!file) return NULL;
+    
+    RangeIndex *index = calloc(1, sizeof(RangeIndex));
+    RangeIndexHeader *header = &index->header;
+    int valid = fread(header, sizeof(*header), 1, file) == 1 &&
+                memcmp(header->magic, RANGE_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+                header->version == RANGE_INDEX_VERSION &&
+                header->block_size == expected->block_size &&
+                header->input_size == expected->input_size &&
+                header->file_size == expected->file_size &&
+                header->file_mtime == expected->file_mtime &&
+                header->block_count <= expected->input_size;
+    if (valid) {
+        index->blocks = malloc(header->block_count * sizeof(IndexBlock));
+        valid = fread(index->blocks, sizeof(IndexBlock), header->block_count, file) == header->block_count;
+    }
+    fclose(file);
+    
+    if (!valid) {
+        free_range_index(index);
+        return NULL;
+    }
+    return index;
+}
+
+void write_range_index(const char *path, const RangeIndex *index) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        perror("Warning: cannot write range index");
+        return;
+    }
+    if (fwrite(&index->header, sizeof(index->header), 1, file) != 1 ||
+        fwrite(index->blocks, sizeof(IndexBlock), index->header.block_count, file) != index->header.block_count) {
+        perror("Error writing range index");
+        exit(1);
+    }
+    fclose(file);
+}
+
+// Loads the sidecar index of input_file, building and saving it first when
+// it is missing or no longer matches the input's size and mtime.
+RangeIndex *load_range_index(const char *input_file, const char *index_path, const char *data, size_t size) {
+    struct stat st;
+    if (stat(input_file, &st) == -1) {
+        perror("stat");
+        exit(1);
+    }
+    
+    RangeIndexHeader expected = {{0}};
+    expected.block_size = INDEX_BLOCK_SIZE;
+    expected.input_size = size;
+    expected.file_size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+    expected.file_mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    expected.file_mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    
+    RangeIndex *index = read_range_index(index_path, &expected);
+    if (index) return index;
+    
+    index = build_range_index(data, size);
+    index->header.file_size = expected.file_size;
+    index->header.file_mtime = expected.file_mtime;
+    write_range_index(index_path, index);
+    return index;
+}
+
+int partition_dest(int dest, int R) {
+    if (options.partition_mode != PARTITION_RANGE) {
+        return dest % R;
+    }
+    
+    int low = 0;
+    int high = R - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (range_boundaries[mid] <= dest) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+size_t parse_size(const char *text) {
+    char *suffix;
+    unsigned long long value = strtoull(text, &suffix, 10);
+    if (suffix == text) {
+        fprintf(stderr, "Invalid size: %s\n", text);
+        exit(1);
+    }
+    if (*suffix == 'K' || *suffix == 'k') value <<= 10;
+    else if (*suffix == 'M' || *suffix == 'm') value <<= 20;
+    else if (*suffix == 'G' || *suffix == 'g') value <<= 30;
+    else if (*suffix != '\0') {
+        fprintf(stderr, "Invalid size: %s\n", text);
+        exit(1);
+    }
+    return (size_t)value;
+}
+
+int parse_output_format(const char *name) {
+    if (strcmp(name, "text") == 0) return OUTPUT_TEXT;
+    if (strcmp(name, "csr") == 0) return OUTPUT_CSR;
+    fprintf(stderr, "Unknown output format: %s\n", name);
+    exit(1);
+}
+
+int parse_partition_mode(const char *name) {
+    if (strcmp(name, "hash") == 0) return PARTITION_HASH;
+    if (strcmp(name, "range") == 0) return PARTITION_RANGE;
+    fprintf(stderr, "Unknown partition mode: %s\n", name);
+    exit(1);
+}
+
+size_t encode_varint(unsigned char *out, int value) {
+    unsigned int v = ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+    size_t length = 0;
+    while (v >= 0x80) {
+        out[length++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[length++] = (unsigned char)v;
+    return length;
+}
+
+int decode_varint(const unsigned char **cursor, const unsigned char *end, int *value) {
+    const unsigned char *p = *cursor;
+    unsigned int v = 0;
+    int shift = 0;
+    
+    while (p < end && shift < 35) {
+        unsigned char byte = *p++;
+        v |= (unsigned int)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int)(v >> 1) ^ -(int)(v & 1);
+            *cursor = p;
+            return 1;
+        }
+        shift += 7;
+    }
+    return 0;
+}
+
+void write_intermediate_pair(OutputBuffer *out, int dest, int source) {
+    if (options.intermediate_format == INTERMEDIATE_BINARY) {
+        Pair pair = {dest, source};
+        output_bytes(out, (const char *)&pair, sizeof(Pair));
+    } else if (options.intermediate_format == INTERMEDIATE_VARINT) {
+        unsigned char buffer[10];
+        size_t length = encode_varint(buffer, dest);
+        length += encode_varint(buffer + length, source);
+        output_bytes(out, (const char *)buffer, length);
+    } else {
+        output_int(out, 0, dest, ' ');
+        output_int(out, 0, source, '\n');
+    }
+}
+
+// Appends pairs decoded from data until it runs out or pairs holds
+// max_pairs, and returns the number of bytes consumed.
+size_t decode_intermediate(const char *data, size_t size, PairBuffer *pairs, Arena *arena, int max_pairs) {
+    if (options.intermediate_format == INTERMEDIATE_BINARY) {
+        size_t count = size / sizeof(Pair);
+        if (count > (size_t)(max_pairs - pairs->count)) count = (size_t)(max_pairs - pairs->count);
+        reserve_pairs(pairs, arena, pairs->count + (int)count);
+        memcpy(pairs->pairs + pairs->count, data, count * sizeof(Pair));
+        pairs->count += (int)count;
+        return count * sizeof(Pair);
+    }
+    
+    if (options.intermediate_format == INTERMEDIATE_VARINT) {
+        const unsigned char *cursor = (const unsigned char *)data;
+        const unsigned char *end = cursor + size;
+        const unsigned char *consumed = cursor;
+        int dest, source;
+        while (pairs->count < max_pairs &&
+               decode_varint(&cursor, end, &dest) && decode_varint(&cursor, end, &source)) {
+            arena_append_pair(pairs, arena, dest, source);
+            consumed = cursor;
+        }
+        return (size_t)(consumed - (const unsigned char *)data);
+    }
+    
+    const char *cursor = data;
+    int dest, source;
+    while (pairs->count < max_pairs && next_edge(&cursor, data + size, &dest, &source)) {
+        arena_append_pair(pairs, arena, dest, source);
+    }
+    return (size_t)(cursor - data);
+}
+
+int parse_intermediate_format(const char *name) {
+    if (strcmp(name, "text") == 0) return INTERMEDIATE_TEXT;
+    if (strcmp(name, "binary") == 0) return INTERMEDIATE_BINARY;
+    if (strcmp(name, "varint") == 0) return INTERMEDIATE_VARINT;
+    fprintf(stderr, "Unknown intermediate format: %s\n", name);
+    exit(1);
+}
+
+void emit_pair(MapperSink *sink, int reducer_index, int dest, int source) {
+    sink->pairs_emitted++;
+    if (sink->ring_batches) {
+        PairBuffer *batch = &sink->ring_batches[reducer_index];
+        if (!batch->pairs) {
+            batch->pairs = malloc(RING_BATCH_SIZE * sizeof(Pair));
+        }
+        batch->pairs[batch->count].dest = dest;
+        batch->pairs[batch->count].source = source;
+        if (++batch->count == RING_BATCH_SIZE) {
+            shm_ring_push(shuffle_ring(&shuffle_region, sink->mapper_index, reducer_index),
+                          &shuffle_region.doorbells[reducer_index], shuffle_region.capacity,
+                          batch->pairs, batch->count);
+            batch->count = 0;
+        }
+    } else {
+        write_intermediate_pair(&sink->intermediate_files[reducer_index], dest, source);
+    }
+}
+
+void flush_combined(Combiner *combiner, int reducer_index, MapperSink *sink) {
+    PairBuffer *batch = combine_batch(combiner, reducer_index);
+    for (int i = 0; i < batch->count; i++) {
+        emit_pair(sink, reducer_index, batch->pairs[i].dest, batch->pairs[i].source);
+    }
+    batch->count = 0;
+}
+
+void map_edges(const char *cursor, const char *end, int R, int MIND, int MAXD,
+               MapperSink *sink, Combiner *combiner) {
+    int source, dest;
+    uint64_t parsed = 0, filtered = 0;
+    while (next_edge(&cursor, end, &source, &dest)) {
+        parsed++;
+        if ((MIND != -1 && dest < MIND) || (MAXD != -1 && dest > MAXD)) {
+            filtered++;
+            continue;
+        }
+        
+        int reducer_index = partition_dest(dest, R);
+        if (sink->sketches) {
+            sketch_table_add(&sink->sketches[reducer_index], dest, source);
+        } else if (!options.combine) {
+            emit_pair(sink, reducer_index, dest, source);
+        } else if (combiner_add(combiner, reducer_index, dest, source)) {
+            flush_combined(combiner, reducer_index, sink);
+        }
+    }
+    sink->edges_parsed += parsed;
+    sink->edges_filtered += filtered;
+}
+
+// Maps [start, end) of the input. With a range index, blocks whose dests all
+// lie outside [MIND, MAXD] are skipped without being parsed.
+void map_input_range(const char *data, size_t start, size_t end, int R, int MIND, int MAXD,
+                     MapperSink *sink, Combiner *combiner) {
+    if (!range_index) {
+        map_edges(data + start, data + end, R, MIND, MAXD, sink, combiner);
+        return;
+    }
+    
+    const IndexBlock *blocks = range_index->blocks;
+    uint64_t block_count = range_index->header.block_count;
+    uint64_t low = 0, high = block_count;
+    while (high - low > 1) {
+        uint64_t mid = (low + high) / 2;
+        if (blocks[mid].offset <= start) low = mid; else high = mid;
+    }
+    
+    for (uint64_t b = low; b < block_count && start < end; b++) {
+        size_t block_end = b + 1 < block_count ? blocks[b + 1].offset : range_index->header.input_size;
+        size_t stop = block_end < end ? block_end : end;
+        if ((MIND == -1 || blocks[b].max_dest >= MIND) && (MAXD == -1 || blocks[b].min_dest <= MAXD)) {
+            map_edges(data + start, data + stop, R, MIND, MAXD, sink, combiner);
+        }
+        start = stop;
+    }
+}
+
+// Maps a streaming mapper's share of stdin, which the parent writes down
+// input_fd in whole-line chunks.
+void map_stream(int input_fd, int R, int MIND, int MAXD, MapperSink *sink, Combiner *combiner) {
+    size_t capacity = STREAM_CHUNK_SIZE;
+    char *buffer = malloc(capacity);
+    size_t length = 0;
+    
+    while (1) {
+        ssize_t n = read(input_fd, buffer + length, capacity - length);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error reading mapper pipe");
+            exit(1);
+        }
+        if (n == 0) break;
+        length += (size_t)n;
+        
+        size_t cut = length;
+        while (cut > 0 && buffer[cut - 1] != '\n') cut--;
+        map_edges(buffer, buffer + cut, R, MIND, MAXD, sink, combiner);
+        memmove(buffer, buffer + cut, length - cut);
+        length -= cut;
+        
+        if (length == capacity) {
+            capacity *= 2;
+            buffer = realloc(buffer, capacity);
+        }
+    }
+    map_edges(buffer, buffer + length, R, MIND, MAXD, sink, combiner);
+    
+    close(input_fd);
+    free(buffer);
+}
+
+void mapper_process(int mapper_id, int R, int MIND, int MAXD, const char *input_data,
+                    size_t input_start, size_t input_end, int input_fd) {
+    double start = run_stats ? stats_clock() : 0;
+    MapperSink sink = {0};
+    sink.mapper_index = mapper_id - 1;
     
-    FILE **split_files = malloc(M * sizeof(FILE *));
-    for (int i = 0; i < M; i++) {
-        char split_name[64];
-        sprintf(split_name, "split-%d", i + 1);
-        split_files[i] = fopen(split_name, "w");
-        if (!split_files[i]) {
-            perror("Error creating split file");
-            exit(1);
+    if (options.approximate) {
+        sink.sketches = calloc(R, sizeof(SketchTable));
+    } else if (options.shm_shuffle) {
+        sink.ring_batches = calloc(R, sizeof(PairBuffer));
+    } else {
+        // A mapper holds R of these open at once, so they get smaller
+        // buffers and at most two each.
+        sink.intermediate_files = malloc(R * sizeof(OutputBuffer));
+        for (int j = 0; j < R; j++) {
+            char intermediate_name[64];
+            sprintf(intermediate_name, "intermediate-%d-%d", mapper_id, j + 1);
+            output_open_sized(&sink.intermediate_files[j], intermediate_name, INTERMEDIATE_BUFFER_SIZE, 2);
         }
     }
     
-    char line[MAX_LINE_LENGTH];
-    int file_index = 0;
+    Combiner combiner;
+    if (options.combine) {
+        combiner_init(&combiner, R);
+    }
     
-    while (fgets(line, MAX_LINE_LENGTH, infile)) {
-        fprintf(split_files[file_index], "%s", line);
-        file_index = (file_index + 1) % M;
+    if (input_fd >= 0) {
+        map_stream(input_fd, R, MIND, MAXD, &sink, &combiner);
+    } else {
+        map_input_range(input_data, input_start, input_end, R, MIND, MAXD, &sink, &combiner);
     }
     
-    fclose(infile);
-    for (int i = 0; i < M; i++) {
-        fclose(split_files[i]);
+    if (options.combine) {
+        for (int j = 0; j < R; j++) {
+            flush_combined(&combiner, j, &sink);
+        }
+        combiner_free(&combiner, R);
     }
-    free(split_files);
-}
-
-void mapper_process(int mapper_id, int R, int MIND, int MAXD) {
-    char split_name[64];
-    sprintf(split_name, "split-%d", mapper_id);
     
-    FILE *split_file = fopen(split_name, "r");
-    if (!split_file) {
-        perror("Error opening split file in mapper");
-        exit(1);
+    if (sink.ring_batches) {
+        for (int j = 0; j < R; j++) {
+            ShmRing *ring = shuffle_ring(&shuffle_region, sink.mapper_index, j);
+            shm_ring_push(ring, &shuffle_region.doorbells[j], shuffle_region.capacity,
+                          sink.ring_batches[j].pairs, sink.ring_batches[j].count);
+            shm_ring_close(ring, &shuffle_region.doorbells[j]);
+            free(sink.ring_batches[j].pairs);
+        }
+        free(sink.ring_batches);
     }
     
-    FILE **intermediate_files = malloc(R * sizeof(FILE *));
-    for (int j = 0; j < R; j++) {
-        char intermediate_name[64];
-        sprintf(intermediate_name, "intermediate-%d-%d", mapper_id, j + 1);
-        intermediate_files[j] = fopen(intermediate_name, "w");
-        if (!intermediate_files[j]) {
-            perror("Error creating intermediate file");
-            exit(1);
+    if (sink.sketches) {
+        for (int j = 0; j < R; j++) {
+            char sketch_name[64];
+            sprintf(sketch_name, "sketch-%d-%d", mapper_id, j + 1);
+            write_sketch_file(&sink.sketches[j], sketch_name);
+            sketch_table_free(&sink.sketches[j]);
         }
+        free(sink.sketches);
     }
     
-    int source, dest;
-    while (fscanf(split_file, "%d %d", &source, &dest) == 2) {
-        if (MIND != -1 && dest < MIND) continue;
-        if (MAXD != -1 && dest > MAXD) continue;
-        
-        int reducer_index = (dest % R);
-        fprintf(intermediate_files[reducer_index], "%d %d\n", dest, source);
+    if (sink.intermediate_files) {
+        for (int j = 0; j < R; j++) {
+            output_close(&sink.intermediate_files[j]);
+        }
+        free(sink.intermediate_files);
     }
     
-    fclose(split_file);
-    for (int j = 0; j < R; j++) {
-        fclose(intermediate_files[j]);
+    if (run_stats) {
+        MapperStats *stats = &run_stats->mappers[mapper_id - 1];
+        stats->start = start;
+        stats->end = stats_clock();
+        stats->edges_parsed = sink.edges_parsed;
+        stats->edges_filtered = sink.edges_filtered;
+        stats->pairs_emitted = sink.pairs_emitted;
     }
-    free(intermediate_files);
 }
 
-void reducer_process(int reducer_id, int M, int R, DestCount *shared_mem, int shared_mem_size) {
-    Pair *all_pairs = malloc(MAX_VERTICES * sizeof(Pair));
-    int pair_count = 0;
+// With a spill set, decoding stops every time spill_pairs are buffered so
+// that they can be sorted out to a run before the file is picked up again.
+void read_intermediate_files(int reducer_id, int M, PairBuffer *pairs, Arena *arena, SpillRuns *spill) {
+    int max_pairs = spill ? options.spill_pairs : INT_MAX;
     
     for (int i = 1; i <= M; i++) {
         char intermediate_name[64];
         sprintf(intermediate_name, "intermediate-%d-%d", i, reducer_id);
         
-        FILE *intermediate_file = fopen(intermediate_name, "r");
-        if (!intermediate_file) continue;
+        int fd = open(intermediate_name, O_RDONLY);
+        if (fd == -1) continue;
         
-        int dest, source;
-        while (fscanf(intermediate_file, "%d %d", &dest, &source) == 2) {
-            all_pairs[pair_count].dest = dest;
-            all_pairs[pair_count].source = source;
-            pair_count++;
+        size_t size;
+        char *data = map_fd(fd, &size);
+        size_t offset = 0;
+        while (1) {
+            offset += decode_intermediate(data + offset, size - offset, pairs, arena, max_pairs);
+            if (pairs->count < max_pairs) break;
+            spill_pair_buffer(spill, pairs, arena);
         }
-        fclose(intermediate_file);
+        unmap_file(data, size);
+        unlink(intermediate_name);
     }
     
-    qsort(all_pairs, pair_count, sizeof(Pair), compare_pairs);
-    
-    char output_name[64];
-    sprintf(output_name, "output-%d", reducer_id);
-    FILE *output_file = fopen(output_name, "w");
-    if (!output_file) {
-        perror("Error creating output file");
-        exit(1);
+    if (spill && spill->run_count > 0 && pairs->count > 0) {
+        spill_pair_buffer(spill, pairs, arena);
     }
+}
+
+// Drains this reducer's column of shared-memory rings while the mappers are
+// still running, sleeping on the reducer's doorbell when every ring is empty.
+// In sort mode pairs are sorted into runs as they arrive and merged at the end.
+// Returns 1 when the pairs come back sorted.
+int ingest_shm_rings(int reducer_id, int M, PairBuffer *pairs, Arena *arena, SpillRuns *spill) {
+    ShmDoorbell *doorbell = &shuffle_region.doorbells[reducer_id - 1];
+    int sort_runs = (options.reducer_mode == REDUCER_SORT || spill != NULL);
+    int run_size = (spill && options.spill_pairs < RUN_SIZE) ? options.spill_pairs : RUN_SIZE;
+    // A run overshoots run_size by at most one batch per mapper, but the sort
+    // scratch grows with the runs actually seen so small inputs stay small.
+    uint64_t *keys = NULL;
+    uint64_t *scratch = NULL;
+    int key_capacity = 0;
+    
+    int run_capacity = 16;
+    int *run_starts = malloc(run_capacity * sizeof(int));
+    int run_count = 0;
+    run_starts[0] = 0;
     
-    int shared_index = (reducer_id - 1) * (shared_mem_size / sizeof(DestCount) / R);
-    int count_index = 0;
+    int *finished = calloc(M, sizeof(int));
+    int open_rings = M;
     
-    if (pair_count > 0) {
-        int current_dest = all_pairs[0].dest;
-        int *sources = malloc(MAX_VERTICES * sizeof(int));
-        int source_count = 0;
-        int prev_source = -1;
+    while (open_rings > 0) {
+        uint32_t sequence = atomic_load(&doorbell->sequence);
+        int received = 0;
         
-        for (int i = 0; i < pair_count; i++) {
-            if (all_pairs[i].dest != current_dest) {
-                fprintf(output_file, "%d:", current_dest);
-                for (int j = 0; j < source_count; j++) {
-                    fprintf(output_file, " %d", sources[j]);
-                }
-                fprintf(output_file, "\n");
-                
-                if (shared_index + count_index < shared_mem_size / sizeof(DestCount)) {
-                    shared_mem[shared_index + count_index].destination = current_dest;
-                    shared_mem[shared_index + count_index].count = source_count;
-                    count_index++;
-                }
-                
-                current_dest = all_pairs[i].dest;
-                source_count = 0;
-                prev_source = -1;
-            }
+        for (int m = 0; m < M; m++) {
+            if (finished[m]) continue;
+            
+            ShmRing *ring = shuffle_ring(&shuffle_region, m, reducer_id - 1);
+            int closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+            reserve_pairs(pairs, arena, pairs->count + RING_BATCH_SIZE);
+            int n = shm_ring_pop(ring, shuffle_region.capacity, pairs->pairs + pairs->count, RING_BATCH_SIZE);
+            pairs->count += n;
+            received += n;
             
-            if (all_pairs[i].source != prev_source) {
-                sources[source_count++] = all_pairs[i].source;
-                prev_source = all_pairs[i].source;
+            if (n == 0 && closed) {
+                finished[m] = 1;
+                open_rings--;
             }
         }
         
-        fprintf(output_file, "%d:", current_dest);
-        for (int j = 0; j < source_count; j++) {
-            fprintf(output_file, " %d", sources[j]);
+        int run_length = pairs->count - run_starts[run_count];
+        if (sort_runs && (run_length >= run_size || (open_rings == 0 && run_length > 0))) {
+            if (run_length > key_capacity) {
+                key_capacity = run_length;
+                free(keys);
+                free(scratch);
+                keys = malloc(key_capacity * sizeof(uint64_t));
+                scratch = malloc(key_capacity * sizeof(uint64_t));
+            }
+            sort_pairs_with_scratch(pairs->pairs + run_starts[run_count], run_length, keys, scratch);
+            if (run_count + 2 > run_capacity) {
+                run_capacity *= 2;
+                run_starts = realloc(run_starts, run_capacity * sizeof(int));
+            }
+            run_starts[++run_count] = pairs->count;
         }
-        fprintf(output_file, "\n");
         
-        if (shared_index + count_index < shared_mem_size / sizeof(DestCount)) {
-            shared_mem[shared_index + count_index].destination = current_dest;
-            shared_mem[shared_index + count_index].count = source_count;
-            count_index++;
+        if (spill && run_count > 0 && run_starts[run_count] == pairs->count &&
+            (pairs->count >= options.spill_pairs || (open_rings == 0 && spill->run_count > 0))) {
+            spill_sorted_runs(spill, pairs->pairs, run_starts, run_count);
+            pairs->count = 0;
+            run_count = 0;
         }
         
-        free(sources);
+        if (received == 0 && open_rings > 0) {
+            atomic_store(&doorbell->consumer_waiting, 1);
+            futex_wait(&doorbell->sequence, sequence);
+            atomic_store(&doorbell->consumer_waiting, 0);
+        }
     }
     
-    for (int i = count_index; i < shared_mem_size / sizeof(DestCount) / R && 
-         shared_index + i < shared_mem_size / sizeof(DestCount); i++) {
-        shared_mem[shared_index + i].destination = -1;
+    if (run_count > 1) {
+        Pair *merged = arena_alloc(arena, pairs->count * sizeof(Pair));
+        merge_runs(pairs->pairs, run_starts, run_count, merged);
+        pairs->pairs = merged;
+        pairs->capacity = pairs->count;
     }
     
-    fclose(output_file);
-    free(all_pairs);
+    free(keys);
+    free(scratch);
+    free(run_starts);
+    free(finished);
+    return sort_runs;
 }
 
-void merge_outputs(int R, const char *out1, const char *out2, DestCount *shared_mem, int shared_mem_size) {
-    typedef struct {
-        int dest;
-        char sources[1024];
-    } OutputLine;
+size_t count_region_header_size(int R) {
+    return (sizeof(CountRegion) + R * sizeof(CountExtent) + 7) & ~(size_t)7;
+}
+
+void count_region_init(CountRegion *region, size_t size, int R) {
+    region->entries_offset = count_region_header_size(R);
+    region->slot_count = (size - region->entries_offset) / sizeof(DestCount);
+    atomic_init(&region->next_slot, 0);
+    for (int i = 0; i < R; i++) {
+        atomic_init(&region->extents[i].state, COUNTS_PENDING);
+    }
+}
+
+DestCount *count_region_entries(CountRegion *region) {
+    return (DestCount *)((char *)region + region->entries_offset);
+}
+
+void spill_adjacency(int reducer_id, const DestCount *counts, int count, const int *sources, int source_count) {
+    char spill_name[64];
+    sprintf(spill_name, "adjacency-%d", reducer_id);
+    OutputBuffer spill;
+    output_open(&spill, spill_name);
+    output_bytes(&spill, (const char *)counts, count * sizeof(DestCount));
+    output_bytes(&spill, (const char *)sources, (size_t)source_count * sizeof(int));
+    output_close(&spill);
+}
+
+// Publishes the reducer's (dest, count) entries followed by its sources, so
+// the parent can write OUT1 and OUT2 without reading output-N back. The
+// extent is reserved with a CAS on the shared bump cursor; a reducer whose
+// adjacency no longer fits spills it to adjacency-N instead, so SHMSIZE only
+// decides how much of it travels through shared memory.
+void publish_adjacency(CountRegion *region, int reducer_id, const Adjacency *adjacency, Arena *arena) {
+    CountExtent *extent = &region->extents[reducer_id - 1];
+    int count = adjacency->dest_count;
+    int source_count = adjacency->sources ? adjacency->offsets[count] : 0;
+    uint64_t slots = count + ((uint64_t)source_count * sizeof(int) + sizeof(DestCount) - 1) / sizeof(DestCount);
+    uint64_t offset = atomic_load(&region->next_slot);
     
-    OutputLine *all_lines = malloc(MAX_VERTICES * sizeof(OutputLine));
-    int line_count = 0;
+    while (offset + slots <= region->slot_count &&
+           !atomic_compare_exchange_weak(&region->next_slot, &offset, offset + slots)) {
+    }
+    int shared = (offset + slots <= region->slot_count);
     
-    for (int i = 1; i <= R; i++) {
+    DestCount *counts = shared
+        ? count_region_entries(region) + offset
+        : arena_alloc(arena, count * sizeof(DestCount));
+    
+    for (int i = 0; i < count; i++) {
+        counts[i].destination = adjacency->dests[i];
+        counts[i].count = adjacency->offsets[i + 1] - adjacency->offsets[i];
+    }
+    
+    extent->count = count;
+    extent->source_count = source_count;
+    if (shared) {
+        if (source_count > 0) {
+            memcpy(counts + count, adjacency->sources, source_count * sizeof(int));
+        }
+        extent->offset = offset;
+        atomic_store(&extent->state, COUNTS_SHARED);
+    } else {
+        spill_adjacency(reducer_id, counts, count, adjacency->sources, source_count);
+        atomic_store(&extent->state, COUNTS_SPILLED);
+    }
+}
+
+void reducer_process(int reducer_id, int M, CountRegion *shared_mem) {
+    Arena arena = {0};
+    PairBuffer pairs = {0};
+    SpillRuns spill = {reducer_id, 0, NULL, NULL};
+    SketchTable sketches = {0};
+    int presorted = 0;
+    ReducerStats *stats = run_stats ? &run_stats->reducers[reducer_id - 1] : NULL;
+    if (stats) stats->start = stats_clock();
+    
+    if (options.approximate) {
+        read_sketch_files(reducer_id, M, &sketches);
+    } else if (options.shm_shuffle) {
+        presorted = ingest_shm_rings(reducer_id, M, &pairs, &arena, options.spill_pairs > 0 ? &spill : NULL);
+    } else {
+        read_intermediate_files(reducer_id, M, &pairs, &arena, options.spill_pairs > 0 ? &spill : NULL);
+    }
+    
+    if (stats) {
+        stats->ingest_end = stats_clock();
+        stats->pairs_received = spill.pairs + pairs.count;
+    }
+    
+    if (spill.run_count > 0) {
+        arena_free(&arena);
+        merge_spilled_runs(&spill);
+        if (stats) {
+            stats->group_end = stats->end = stats_clock();
+            stats->dests = spill.dests;
+            stats->sources = spill.sources;
+            stats->spill_runs = spill.run_count;
+        }
+        atomic_store(&shared_mem->extents[reducer_id - 1].state, COUNTS_STREAMED);
+        return;
+    }
+    
+    Pair *all_pairs = pairs.pairs;
+    int pair_count = pairs.count;
+    
+    Adjacency adjacency;
+    if (options.approximate) {
+        estimate_adjacency(&sketches, &adjacency, &arena);
+        sketch_table_free(&sketches);
+    } else if (presorted) {
+        group_sorted_pairs(all_pairs, pair_count, &adjacency, &arena);
+    } else {
+        group_pairs(all_pairs, pair_count, &adjacency, &arena);
+    }
+    
+    if (stats) {
+        stats->group_end = stats_clock();
+        stats->dests = adjacency.dest_count;
+        stats->sources = adjacency.offsets[adjacency.dest_count];
+    }
+    
+    if (options.reducer_outputs) {
         char output_name[64];
-        sprintf(output_name, "output-%d", i);
+        sprintf(output_name, "output-%d", reducer_id);
+        OutputBuffer output;
+        output_open(&output, output_name);
+        write_adjacency(&output, &adjacency);
+        output_close(&output);
+    }
+    
+    publish_adjacency(shared_mem, reducer_id, &adjacency, &arena);
+    arena_free(&arena);
+    if (stats) stats->end = stats_clock();
+}
+
+typedef void (*EntryVisitor)(const DestCount *entry, const int *sources, void *context);
+
+// Collapses consecutive visits of the same dest into one entry whose
+// sources are the sorted union, for merges that see a dest more than once.
+typedef struct {
+    EntryVisitor visit;
+    void *context;
+    int pending;
+    DestCount entry;
+    const int *sources;
+    int *buffer;
+    int *spare;
+    int capacity;
+} EntryUnion;
+
+// A previous OUT1 loaded as one more cursor for an incremental merge.
+typedef struct {
+    char *data;
+    size_t size;
+    DestCount *counts;
+    int *sources;
+} PreviousResult;
+
+void union_flush(EntryUnion *merged) {
+    if (merged->pending) {
+        merged->visit(&merged->entry, merged->sources, merged->context);
+        merged->pending = 0;
+    }
+}
+
+void union_entry(const DestCount *entry, const int *sources, void *context) {
+    EntryUnion *merged = context;
+    
+    if (!merged->pending || entry->destination != merged->entry.destination) {
+        union_flush(merged);
+        merged->pending = 1;
+        merged->entry = *entry;
+        merged->sources = sources;
+        return;
+    }
+    
+    int needed = merged->entry.count + entry->count;
+    if (needed > merged->capacity) {
+        merged->capacity = needed * 2;
+        int *grown = malloc(merged->capacity * sizeof(int));
+        if (merged->sources == merged->buffer) {
+            memcpy(grown, merged->buffer, merged->entry.count * sizeof(int));
+            merged->sources = grown;
+        }
+        free(merged->buffer);
+        free(merged->spare);
+        merged->buffer = grown;
+        merged->spare = malloc(merged->capacity * sizeof(int));
+    }
+    
+    const int *a = merged->sources;
+    int a_count = merged->entry.count;
+    int i = 0, j = 0, count = 0;
+    while (i < a_count || j < entry->count) {
+        int value;
+        if (j == entry->count || (i < a_count && a[i] < sources[j])) {
+            value = a[i++];
+        } else if (i == a_count || sources[j] < a[i]) {
+            value = sources[j++];
+        } else {
+            value = a[i++];
+            j++;
+        }
+        merged->spare[count++] = value;
+    }
+    
+    int *swap = merged->buffer;
+    merged->buffer = merged->spare;
+    merged->spare = swap;
+    merged->sources = merged->buffer;
+    merged->entry.count = count;
+}
+
+int cursor_less(const AdjacencyCursor *a, const AdjacencyCursor *b) {
+    return a->counts[a->position].destination < b->counts[b->position].destination;
+}
+
+void heap_sift_down(AdjacencyCursor **heap, int heap_size, int index) {
+    while (1) {
+        int smallest = index;
+        int left = 2 * index + 1;
+        int right = 2 * index + 2;
         
-        FILE *output_file = fopen(output_name, "r");
-        if (!output_file) continue;
+        if (left < heap_size && cursor_less(heap[left], heap[smallest])) smallest = left;
+        if (right < heap_size && cursor_less(heap[right], heap[smallest])) smallest = right;
+        if (smallest == index) break;
         
-        char line[2048];
-        while (fgets(line, 2048, output_file)) {
-            int dest;
-            char sources[1024];
-            
-            if (sscanf(line, "%d:%[^\n]", &dest, sources) == 2) {
-                all_lines[line_count].dest = dest;
-                strcpy(all_lines[line_count].sources, sources);
-                line_count++;
+        AdjacencyCursor *temp = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = temp;
+        index = smallest;
+    }
+}
+
+void visit_cursor_entry(AdjacencyCursor *cursor, EntryVisitor visit, void *context) {
+    const DestCount *entry = &cursor->counts[cursor->position++];
+    visit(entry, cursor->sources ? cursor->sources + cursor->source_position : NULL, context);
+    cursor->source_position += entry->count;
+}
+
+// Visits every published dest in ascending order. Hash partitioning
+// interleaves dests across reducers, so they are merged through a heap;
+// range-partitioned reducers already own consecutive dest ranges. A dest
+// that several cursors hold, which only happens with a previous result, is
+// visited once with the union of their sources.
+void merge_adjacency(AdjacencyCursor *cursors, int R, EntryVisitor visit, void *context) {
+    for (int i = 0; i < R; i++) {
+        cursors[i].position = 0;
+        cursors[i].source_position = 0;
+    }
+    
+    if (options.partition_mode == PARTITION_RANGE && !options.previous_path) {
+        for (int i = 0; i < R; i++) {
+            while (cursors[i].position < cursors[i].count) {
+                visit_cursor_entry(&cursors[i], visit, context);
             }
         }
-        fclose(output_file);
+        return;
     }
     
-    for (int i = 0; i < line_count - 1; i++) {
-        for (int j = 0; j < line_count - i - 1; j++) {
-            if (all_lines[j].dest > all_lines[j + 1].dest) {
-                OutputLine temp = all_lines[j];
-                all_lines[j] = all_lines[j + 1];
-                all_lines[j + 1] = temp;
-            }
+    AdjacencyCursor **heap = malloc(R * sizeof(AdjacencyCursor *));
+    int heap_size = 0;
+    for (int i = 0; i < R; i++) {
+        if (cursors[i].count > 0) {
+            heap[heap_size++] = &cursors[i];
         }
     }
+    for (int i = heap_size / 2 - 1; i >= 0; i--) {
+        heap_sift_down(heap, heap_size, i);
+    }
     
-    FILE *out1_file = fopen(out1, "w");
-    if (!out1_file) {
-        perror("Error creating OUT1 file");
-        exit(1);
+    EntryUnion merged = {visit, context};
+    while (heap_size > 0) {
+        AdjacencyCursor *top = heap[0];
+        visit_cursor_entry(top, union_entry, &merged);
+        if (top->position == top->count) {
+            heap[0] = heap[--heap_size];
+        }
+        heap_sift_down(heap, heap_size, 0);
     }
+    union_flush(&merged);
+    free(merged.buffer);
+    free(merged.spare);
+    free(heap);
+}
+
+typedef struct {
+    OutputBuffer out1;
+    OutputBuffer out2;
+} TextOutputs;
+
+void write_text_entry(const DestCount *entry, const int *sources, void *context) {
+    TextOutputs *outputs = context;
     
-    for (int i = 0; i < line_count; i++) {
-        fprintf(out1_file, "%d:%s\n", all_lines[i].dest, all_lines[i].sources);
+    output_int(&outputs->out1, 0, entry->destination, ':');
+    for (int i = 0; i < entry->count; i++) {
+        output_int(&outputs->out1, ' ', sources[i], 0);
     }
-    fclose(out1_file);
+    output_bytes(&outputs->out1, "\n", 1);
+    
+    output_int(&outputs->out2, 0, entry->destination, ':');
+    output_int(&outputs->out2, ' ', entry->count, '\n');
+}
+
+void write_count_entry(const DestCount *entry, const int *sources, void *context) {
+    OutputBuffer *out2 = context;
+    output_int(out2, 0, entry->destination, ':');
+    output_int(out2, ' ', entry->count, '\n');
+}
+
+// out1 is NULL when only the counts are written.
+typedef struct {
+    OutputBuffer *out1;
+    OutputBuffer *out2;
+    int64_t next_dest;
+    uint64_t offset;
+} CsrIndexWriter;
+
+// Emits offsets[d - min_dest] (and a zero count) for every dest up to and
+// including this entry's, so dests with no in-edges get an empty range.
+void write_csr_index_entry(const DestCount *entry, const int *sources, void *context) {
+    CsrIndexWriter *writer = context;
+    uint32_t zero = 0;
     
-    DestCount *all_counts = malloc(MAX_VERTICES * sizeof(DestCount));
-    int count_total = 0;
+    for (; writer->next_dest < entry->destination; writer->next_dest++) {
+        if (writer->out1) output_bytes(writer->out1, (const char *)&writer->offset, sizeof(uint64_t));
+        output_bytes(writer->out2, (const char *)&zero, sizeof(uint32_t));
+    }
+    uint32_t count = (uint32_t)entry->count;
+    if (writer->out1) output_bytes(writer->out1, (const char *)&writer->offset, sizeof(uint64_t));
+    output_bytes(writer->out2, (const char *)&count, sizeof(uint32_t));
+    writer->offset += count;
+    writer->next_dest++;
+}
+
+void write_csr_sources_entry(const DestCount *entry, const int *sources, void *context) {
+    output_bytes(context, (const char *)sources, entry->count * sizeof(int));
+}
+
+void count_entry_sources(const DestCount *entry, const int *sources, void *context) {
+    *(uint64_t *)context += entry->count;
+}
+
+// OUT1 becomes a CsrHeader, uint64_t offsets[dest_range + 1] and the packed
+// int32_t sources; the in-neighbours of d are sources[offsets[d - min_dest]
+// .. offsets[d - min_dest + 1]). OUT2 becomes a CsrHeader followed by
+// uint32_t counts[dest_range]. Both use host byte order. With counts_only
+// OUT1 is left empty. Files grow with the span of dest IDs, not the edges, so
+// widely spaced IDs are refused rather than padded out to gigabytes.
+void write_csr_outputs(AdjacencyCursor *cursors, int R, const char *out1, const char *out2) {
+    CsrHeader header = {0};
+    int min_dest = INT_MAX;
+    int max_dest = INT_MIN;
+    uint64_t dest_count = 0;
     
-    for (int i = 0; i < shared_mem_size / sizeof(DestCount); i++) {
-        if (shared_mem[i].destination != -1 && shared_mem[i].destination != 0) {
-            all_counts[count_total++] = shared_mem[i];
+    for (int i = 0; i < R; i++) {
+        dest_count += cursors[i].count;
+        if (cursors[i].count == 0) continue;
+        if (cursors[i].counts[0].destination < min_dest) min_dest = cursors[i].counts[0].destination;
+        if (cursors[i].counts[cursors[i].count - 1].destination > max_dest) {
+            max_dest = cursors[i].counts[cursors[i].count - 1].destination;
+        }
+        for (int j = 0; j < cursors[i].count; j++) {
+            header.source_count += cursors[i].counts[j].count;
         }
     }
     
-    qsort(all_counts, count_total, sizeof(DestCount), compare_dest_counts);
+    // Dests shared with a previous result are counted once, after the union.
+    if (options.previous_path) {
+        header.source_count = 0;
+        merge_adjacency(cursors, R, count_entry_sources, &header.source_count);
+    }
     
-    FILE *out2_file = fopen(out2, "w");
-    if (!out2_file) {
-        perror("Error creating OUT2 file");
+    header.version = CSR_VERSION;
+    if (min_dest <= max_dest) {
+        header.min_dest = min_dest;
+        header.dest_range = (uint64_t)((int64_t)max_dest - min_dest + 1);
+    }
+    if (header.dest_range > CSR_MAX_SPAN_FACTOR * dest_count + CSR_SPAN_SLACK) {
+        fprintf(stderr, "--output-format=csr would pad %llu dests out to a span of %llu IDs (%d to %d); "
+                "use --output-format=text for IDs this sparse\n",
+                (unsigned long long)dest_count, (unsigned long long)header.dest_range, min_dest, max_dest);
         exit(1);
     }
     
-    for (int i = 0; i < count_total; i++) {
-        fprintf(out2_file, "%d: %d\n", all_counts[i].destination, all_counts[i].count);
+    OutputBuffer out1_file, out2_file;
+    output_open(&out1_file, out1);
+    output_open(&out2_file, out2);
+    
+    if (!options.counts_only) {
+        memcpy(header.magic, CSR_ADJACENCY_MAGIC, sizeof(header.magic));
+        output_bytes(&out1_file, (const char *)&header, sizeof(header));
+    }
+    memcpy(header.magic, CSR_COUNTS_MAGIC, sizeof(header.magic));
+    output_bytes(&out2_file, (const char *)&header, sizeof(header));
+    
+    CsrIndexWriter writer = {options.counts_only ? NULL : &out1_file, &out2_file, header.min_dest, 0};
+    merge_adjacency(cursors, R, write_csr_index_entry, &writer);
+    if (!options.counts_only) {
+        output_bytes(&out1_file, (const char *)&writer.offset, sizeof(uint64_t));
+        merge_adjacency(cursors, R, write_csr_sources_entry, &out1_file);
+    }
+    
+    output_close(&out1_file);
+    output_close(&out2_file);
+}
+
+// Reads a previous OUT1, in either output format, into cursor. Text lines
+// are parsed into counts and sources; a CSR file is used in place, with only
+// its non-empty dests turned into counts.
+void load_previous_result(const char *path, AdjacencyCursor *cursor, PreviousResult *previous) {
+    memset(cursor, 0, sizeof(*cursor));
+    memset(previous, 0, sizeof(*previous));
+    previous->data = map_input_file(path, &previous->size);
+    const char *data = previous->data;
+    size_t size = previous->size;
+    
+    if (size >= sizeof(CsrHeader) && memcmp(data, CSR_ADJACENCY_MAGIC, 8) == 0) {
+        CsrHeader header;
+        memcpy(&header, data, sizeof(header));
+        const uint64_t *offsets = (const uint64_t *)(data + sizeof(header));
+        if (header.version != CSR_VERSION ||
+            sizeof(header) + (header.dest_range + 1) * sizeof(uint64_t) + header.source_count * sizeof(int) > size) {
+            fprintf(stderr, "%s: not a CSR adjacency this version can read\n", path);
+            exit(1);
+        }
+        
+        int count = 0;
+        for (uint64_t d = 0; d < header.dest_range; d++) {
+            count += offsets[d + 1] != offsets[d];
+        }
+        previous->counts = malloc(count * sizeof(DestCount) + 1);
+        count = 0;
+        for (uint64_t d = 0; d < header.dest_range; d++) {
+            if (offsets[d + 1] == offsets[d]) continue;
+            previous->counts[count].destination = (int)(header.min_dest + (int64_t)d);
+            previous->counts[count].count = (int)(offsets[d + 1] - offsets[d]);
+            count++;
+        }
+        cursor->counts = previous->counts;
+        cursor->sources = (const int *)(offsets + header.dest_range + 1);
+        cursor->count = count;
+        return;
+    }
+    
+    int count_capacity = 1024, source_capacity = 1 << 16;
+    int count = 0, source_count = 0;
+    previous->counts = malloc(count_capacity * sizeof(DestCount));
+    previous->sources = malloc(source_capacity * sizeof(int));
+    
+    const char *p = data;
+    const char *end = data + size;
+    while (p < end) {
+        const char *line_end = memchr(p, '\n', end - p);
+        if (!line_end) line_end = end;
+        
+        if (line_end == p) {
+            p++;
+            continue;
+        }
+        
+        int dest;
+        const char *q = p;
+        if (!parse_int(&q, line_end, &dest) || q >= line_end || *q != ':') {
+            fprintf(stderr, "%s: malformed line at byte %zu\n", path, (size_t)(p - data));
+            exit(1);
+        }
+        q++;
+        
+        int first = source_count;
+        int source;
+        while (parse_int(&q, line_end, &source)) {
+            if (source_count == source_capacity) {
+                source_capacity *= 2;
+                previous->sources = realloc(previous->sources, source_capacity * sizeof(int));
+            }
+            previous->sources[source_count++] = source;
+        }
+        
+        if (count == count_capacity) {
+            count_capacity *= 2;
+            previous->counts = realloc(previous->counts, count_capacity * sizeof(DestCount));
+        }
+        previous->counts[count].destination = dest;
+        previous->counts[count].count = source_count - first;
+        count++;
+        p = line_end + 1;
+    }
+    
+    cursor->counts = previous->counts;
+    cursor->sources = previous->sources;
+    cursor->count = count;
+}
+
+void release_previous_result(PreviousResult *previous) {
+    unmap_file(previous->data, previous->size);
+    free(previous->counts);
+    free(previous->sources);
+}
+
+void write_text_outputs(AdjacencyCursor *cursors, int R, const char *out1, const char *out2) {
+    TextOutputs outputs;
+    output_open(&outputs.out1, out1);
+    output_open(&outputs.out2, out2);
+    if (options.counts_only) {
+        merge_adjacency(cursors, R, write_count_entry, &outputs.out2);
+    } else {
+        merge_adjacency(cursors, R, write_text_entry, &outputs);
+    }
+    output_close(&outputs.out1);
+    output_close(&outputs.out2);
+}
+
+// With --previous, the earlier OUT1 joins the merge as one more cursor.
+void write_merged_outputs(AdjacencyCursor *cursors, int R, const char *out1, const char *out2) {
+    PreviousResult previous;
+    if (options.previous_path) {
+        AdjacencyCursor *all = malloc((R + 1) * sizeof(AdjacencyCursor));
+        memcpy(all, cursors, R * sizeof(AdjacencyCursor));
+        load_previous_result(options.previous_path, &all[R], &previous);
+        cursors = all;
+        R++;
+    }
+    
+    if (options.output_format == OUTPUT_CSR) {
+        write_csr_outputs(cursors, R, out1, out2);
+    } else {
+        write_text_outputs(cursors, R, out1, out2);
+    }
+    
+    if (options.previous_path) {
+        release_previous_result(&previous);
+        free(cursors);
+    }
+}
+
+void merge_outputs(int R, const char *out1, const char *out2, CountRegion *shared_mem) {
+    AdjacencyCursor *cursors = calloc(R, sizeof(AdjacencyCursor));
+    StreamedAdjacency *streamed = calloc(R, sizeof(StreamedAdjacency));
+    char **spill_data = calloc(R, sizeof(char *));
+    size_t *spill_sizes = calloc(R, sizeof(size_t));
+    
+    for (int i = 0; i < R; i++) {
+        CountExtent *extent = &shared_mem->extents[i];
+        int state = atomic_load(&extent->state);
+        const DestCount *counts = NULL;
+        
+        if (state == COUNTS_SHARED) {
+            counts = count_region_entries(shared_mem) + extent->offset;
+        } else if (state == COUNTS_SPILLED) {
+            char spill_name[64];
+            sprintf(spill_name, "adjacency-%d", i + 1);
+            spill_data[i] = map_input_file(spill_name, &spill_sizes[i]);
+            counts = (const DestCount *)spill_data[i];
+        } else if (state == COUNTS_STREAMED) {
+            map_streamed_adjacency(i + 1, &cursors[i], &streamed[i]);
+            continue;
+        } else {
+            continue;
+        }
+        
+        cursors[i].counts = counts;
+        cursors[i].sources = options.counts_only ? NULL : (const int *)(counts + extent->count);
+        cursors[i].count = extent->count;
     }
-    fclose(out2_file);
     
-    free(all_lines);
-    free(all_counts);
+    write_merged_outputs(cursors, R, out1, out2);
+    
+    for (int i = 0; i < R; i++) {
+        unmap_file(spill_data[i], spill_sizes[i]);
+        if (atomic_load(&shared_mem->extents[i].state) == COUNTS_SPILLED) {
+            char spill_name[64];
+            sprintf(spill_name, "adjacency-%d", i + 1);
+            unlink(spill_name);
+        }
+        if (streamed[i].mapped) {
+            release_streamed_adjacency(i + 1, &streamed[i]);
+        }
+    }
+    free(spill_data);
+    free(spill_sizes);
+    free(streamed);
+    free(cursors);
+}
+
+void write_chunk_to_mapper(char *data, size_t length, void *context) {
+    PipeFanout *fanout = context;
+    output_write_all(fanout->fds[fanout->next], data, length);
+    fanout->next = (fanout->next + 1) % fanout->count;
+    free(data);
+}
+
+void fork_reducers(int M, int R, CountRegion *shared_mem) {
+    for (int i = 1; i <= R; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            reducer_process(i, M, shared_mem);
+            exit(0);
+        } else if (pid < 0) {
+            perror("Fork failed for reducer");
+            exit(1);
+        }
+    }
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 9) {
-        fprintf(stderr, "Usage: %s INFILE M R OUT1 OUT2 MIND MAXD SHMSIZE\n", argv[0]);
+    if (argc < 9) {
+        fprintf(stderr, "Usage: %s INFILE|- M R OUT1 OUT2 MIND MAXD SHMSIZE [--shm-shuffle] [--intermediate=text|binary|varint] [--reducer=sort|hash] [--combine] [--partition=hash|range] [--direct-output] [--reducer-outputs] [--output-format=text|csr] [--index[=PATH]] [--previous=OUT1] [--counts-only] [--approximate[=ERROR]] [--memory-budget=BYTES[K|M|G]] [--stats=PATH] [--stats-format=json|csv] [--io=sync|uring|threads] [--io-depth=N]\n", argv[0]);
         exit(1);
     }
     
@@ -288,6 +3873,62 @@ int main(int argc, char *argv[]) {
     int MAXD = atoi(argv[7]);
     int SHMSIZE = atoi(argv[8]);
     
+    size_t memory_budget = 0;
+    
+    for (int i = 9; i < argc; i++) {
+        if (strcmp(argv[i], "--shm-shuffle") == 0) {
+            options.shm_shuffle = 1;
+        } else if (strncmp(argv[i], "--intermediate=", 15) == 0) {
+            options.intermediate_format = parse_intermediate_format(argv[i] + 15);
+        } else if (strncmp(argv[i], "--reducer=", 10) == 0) {
+            options.reducer_mode = parse_reducer_mode(argv[i] + 10);
+        } else if (strncmp(argv[i], "--partition=", 12) == 0) {
+            options.partition_mode = parse_partition_mode(argv[i] + 12);
+        } else if (strcmp(argv[i], "--combine") == 0) {
+            options.combine = 1;
+        } else if (strcmp(argv[i], "--direct-output") == 0) {
+            options.direct_output = 1;
+        } else if (strcmp(argv[i], "--reducer-outputs") == 0) {
+            options.reducer_outputs = 1;
+        } else if (strncmp(argv[i], "--memory-budget=", 16) == 0) {
+            memory_budget = parse_size(argv[i] + 16);
+        } else if (strncmp(argv[i], "--output-format=", 16) == 0) {
+            options.output_format = parse_output_format(argv[i] + 16);
+        } else if (strcmp(argv[i], "--approximate") == 0) {
+            options.approximate = 1;
+            options.sketch_precision = sketch_precision(SKETCH_DEFAULT_ERROR);
+        } else if (strncmp(argv[i], "--approximate=", 14) == 0) {
+            options.approximate = 1;
+            options.sketch_precision = parse_sketch_error(argv[i] + 14);
+        } else if (strncmp(argv[i], "--previous=", 11) == 0) {
+            options.previous_path = argv[i] + 11;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            options.index_path = "";
+        } else if (strncmp(argv[i], "--index=", 8) == 0) {
+            options.index_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--counts-only") == 0) {
+            options.counts_only = 1;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            options.stats_path = argv[i] + 8;
+        } else if (strncmp(argv[i], "--stats-format=", 15) == 0) {
+            options.stats_format = parse_stats_format(argv[i] + 15);
+        } else if (strncmp(argv[i], "--io=", 5) == 0) {
+            options.io_backend = parse_io_backend(argv[i] + 5);
+        } else if (strncmp(argv[i], "--io-depth=", 11) == 0) {
+            options.io_depth = atoi(argv[i] + 11);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    
+    if (options.io_depth <= 0) {
+        options.io_depth = IO_DEFAULT_DEPTH;
+    }
+    if (options.io_backend != IO_SYNC) {
+        io_init();
+    }
+    
     if (M < 1 || M > 20) {
         fprintf(stderr, "M must be between 1 and 20\n");
         exit(1);
@@ -298,25 +3939,91 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
-    split_input_file(input_file, M);
+    // Streaming input is mapped as it arrives, so the reducers have to run
+    // alongside the mappers on the shared-memory rings.
+    if (strcmp(input_file, "-") == 0) {
+        if (options.partition_mode == PARTITION_RANGE) {
+            fprintf(stderr, "--partition=range needs a seekable INFILE to sample\n");
+            exit(1);
+        }
+        if (options.index_path) {
+            fprintf(stderr, "--index needs a seekable INFILE to index\n");
+            exit(1);
+        }
+        options.streaming = 1;
+        options.shm_shuffle = 1;
+    }
     
-    for (int i = 1; i <= M; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            mapper_process(i, R, MIND, MAXD);
-            exit(0);
-        } else if (pid < 0) {
-            perror("Fork failed for mapper");
+    // Sketches keep no sources, so the approximate mode always runs counts
+    // only, and they reach the reducers through sketch-M-N files once every
+    // mapper is done. Dests start out exact and sparse until they hold 1/8
+    // of a dense sketch's bytes in hashes.
+    if (options.approximate) {
+        options.counts_only = 1;
+        options.sketch_sparse_limit = (1 << options.sketch_precision) / 64;
+        options.shm_shuffle = 0;
+    }
+    
+    // An incremental run unions sources with the previous OUT1, so it keeps
+    // them whatever OUT1 is; and OUT1 is truncated while the previous one is
+    // still being read, so the two must be different files.
+    if (options.previous_path) {
+        struct stat previous_stat, out1_stat;
+        if (options.counts_only || options.approximate) {
+            fprintf(stderr, "--previous merges sources, which --counts-only and --approximate drop\n");
+            exit(1);
+        }
+        if (stat(options.previous_path, &previous_stat) == -1) {
+            perror(options.previous_path);
+            exit(1);
+        }
+        if (stat(out1, &out1_stat) == 0 && out1_stat.st_dev == previous_stat.st_dev &&
+            out1_stat.st_ino == previous_stat.st_ino) {
+            fprintf(stderr, "--previous must name a different file than OUT1\n");
             exit(1);
         }
     }
     
-    for (int i = 0; i < M; i++) {
-        wait(NULL);
+    // Nothing would be read back from OUT1, so the sources are never kept,
+    // unless --reducer-outputs writes them to per-reducer files instead.
+    if (strcmp(out1, "/dev/null") == 0 && !options.previous_path && !options.reducer_outputs) {
+        options.counts_only = 1;
+    }
+    if (options.counts_only && options.reducer_outputs) {
+        fprintf(stderr, "--reducer-outputs needs the adjacency that --counts-only skips\n");
+        exit(1);
+    }
+    
+    // The budget is per reducer and covers its pair buffer and sort keys.
+    if (memory_budget > 0) {
+        size_t spill_pairs = memory_budget / SPILL_BYTES_PER_PAIR;
+        if (spill_pairs < SPILL_MIN_PAIRS) spill_pairs = SPILL_MIN_PAIRS;
+        if (spill_pairs > INT_MAX / 2) spill_pairs = INT_MAX / 2;
+        options.spill_pairs = (int)spill_pairs;
+    } else if (options.streaming) {
+        options.spill_pairs = STREAM_SPILL_PAIRS;
+    }
+    
+    if (options.stats_path) {
+        run_stats = stats_create(M, R);
+    }
+    
+    size_t input_size = 0;
+    char *input_data = NULL;
+    if (!options.streaming) {
+        input_data = load_input(input_file, &input_size, M);
     }
     
     int shared_mem_size = 1 << SHMSIZE;
     
+    if (options.shm_shuffle) {
+        shuffle_region_create(&shuffle_region, M, R, shared_mem_size);
+    }
+    
+    if ((size_t)shared_mem_size < count_region_header_size(R)) {
+        shared_mem_size = (int)count_region_header_size(R);
+    }
+    
     int shm_fd = shm_open("/findsp_shm", O_CREAT | O_RDWR, 0666);
     if (shm_fd == -1) {
         perror("shm_open");
@@ -328,31 +4035,100 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     
-    DestCount *shared_mem = mmap(NULL, shared_mem_size, PROT_READ | PROT_WRITE, 
-                                 MAP_SHARED, shm_fd, 0);
+    CountRegion *shared_mem = mmap(NULL, shared_mem_size, PROT_READ | PROT_WRITE, 
+                                   MAP_SHARED, shm_fd, 0);
     if (shared_mem == MAP_FAILED) {
         perror("mmap");
         exit(1);
     }
     
     memset(shared_mem, 0, shared_mem_size);
+    count_region_init(shared_mem, shared_mem_size, R);
     
-    for (int i = 1; i <= R; i++) {
+    if (options.partition_mode == PARTITION_RANGE) {
+        range_boundaries = build_range_boundaries(input_data, input_size, R, MIND, MAXD);
+    }
+    
+    // The index only pays off for a range query; --index alone puts it next
+    // to INFILE as INFILE.idx.
+    char *index_path = NULL;
+    if (options.index_path && (MIND != -1 || MAXD != -1)) {
+        index_path = malloc(strlen(input_file) + 5);
+        sprintf(index_path, "%s.idx", input_file);
+        range_index = load_range_index(input_file, options.index_path[0] ? options.index_path : index_path,
+                                       input_data, input_size);
+    }
+    if (run_stats) run_stats->load_end = stats_clock();
+    
+    if (options.shm_shuffle) {
+        fork_reducers(M, R, shared_mem);
+    }
+    
+    // Each streaming mapper reads its own pipe; a child closes the write ends
+    // it inherits so that it sees EOF once the parent finishes stdin.
+    int *stream_fds = options.streaming ? malloc(M * sizeof(int)) : NULL;
+    
+    for (int i = 1; i <= M; i++) {
+        size_t input_start = align_to_line(input_data, input_size, input_size * (i - 1) / M);
+        size_t input_end = align_to_line(input_data, input_size, input_size * i / M);
+        int pipe_fds[2] = {-1, -1};
+        if (options.streaming && pipe(pipe_fds) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        
         pid_t pid = fork();
         if (pid == 0) {
-            reducer_process(i, M, R, shared_mem, shared_mem_size);
+            if (options.streaming) {
+                close(pipe_fds[1]);
+                for (int j = 0; j < i - 1; j++) {
+                    close(stream_fds[j]);
+                }
+            }
+            mapper_process(i, R, MIND, MAXD, input_data, input_start, input_end, pipe_fds[0]);
             exit(0);
         } else if (pid < 0) {
-            perror("Fork failed for reducer");
+            perror("Fork failed for mapper");
             exit(1);
         }
+        
+        if (options.streaming) {
+            close(pipe_fds[0]);
+            stream_fds[i - 1] = pipe_fds[1];
+        }
     }
     
-    for (int i = 0; i < R; i++) {
+    if (options.streaming) {
+        PipeFanout fanout = {stream_fds, M, 0};
+        read_stream_chunks(STDIN_FILENO, write_chunk_to_mapper, &fanout);
+        for (int i = 0; i < M; i++) {
+            close(stream_fds[i]);
+        }
+        free(stream_fds);
+    }
+    
+    if (!options.shm_shuffle) {
+        for (int i = 0; i < M; i++) {
+            wait(NULL);
+        }
+        fork_reducers(M, R, shared_mem);
+    }
+    
+    for (int i = 0; i < (options.shm_shuffle ? M + R : R); i++) {
         wait(NULL);
     }
+    if (run_stats) run_stats->shuffle_end = stats_clock();
+    unmap_file(input_data, input_size);
+    free(range_boundaries);
+    free_range_index(range_index);
+    free(index_path);
     
-    merge_outputs(R, out1, out2, shared_mem, shared_mem_size);
+    if (options.shm_shuffle) {
+        shuffle_region_destroy(&shuffle_region);
+    }
+    
+    merge_outputs(R, out1, out2, shared_mem);
+    if (run_stats) run_stats->merge_end = stats_clock();
     
     if (munmap(shared_mem, shared_mem_size) == -1) {
         perror("munmap");
@@ -364,5 +4140,11 @@ int main(int argc, char *argv[]) {
     
     close(shm_fd);
     
+    if (run_stats) {
+        write_stats(options.stats_path, "findsp");
+        stats_destroy(run_stats);
+    }
+    io_stop();
+    
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,497 @@
+// Generates synthetic edge lists for scaling tests. Edges are produced in
+// fixed-size chunks, each from its own seeded generator, so the output only
+// depends on the seed and the options, never on the thread count.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+
+#define CHUNK_EDGES (1 << 20)
+#define TEXT_BYTES_PER_EDGE 24
+#define DUPLICATE_WINDOW 4096
+
+// BGZF caps a block's uncompressed payload so that the compressed block,
+// header included, always fits its 16-bit size field.
+#define BGZF_BLOCK_INPUT 0xff00
+#define BGZF_HEADER_SIZE 18
+#define BGZF_FOOTER_SIZE 8
+
+#define MODEL_UNIFORM 0
+#define MODEL_RMAT 1
+#define MODEL_ZIPF 2
+
+#define FORMAT_TEXT 0
+#define FORMAT_BINARY 1
+#define FORMAT_GZIP 2
+
+typedef struct {
+    int model;
+    int format;
+    int thread_count;
+    uint64_t edge_count;
+    int64_t vertex_count;
+    uint64_t seed;
+    double duplicates;
+    double rmat_a;
+    double rmat_b;
+    double rmat_c;
+    double zipf_exponent;
+} Options;
+
+// Constants of the rejection-inversion Zipf sampler, fixed per run.
+typedef struct {
+    double exponent;
+    double h_integral_x1;
+    double h_integral_n;
+    double s;
+} ZipfSampler;
+
+typedef struct {
+    int32_t source;
+    int32_t dest;
+} Edge;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+typedef struct {
+    int fd;
+    uint64_t chunk_count;
+    uint64_t next_chunk;
+    uint64_t next_write;
+    pthread_mutex_t mutex;
+    pthread_cond_t turn;
+} Writer;
+
+Options options;
+ZipfSampler zipf;
+int rmat_scale;
+
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+uint64_t random_below(uint64_t *state, uint64_t bound) {
+    return splitmix64(state) % bound;
+}
+
+double random_unit(uint64_t *state) {
+    return (splitmix64(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double zipf_h_integral(double x) {
+    double log_x = log(x);
+    double t = (1 - zipf.exponent) * log_x;
+    return fabs(t) > 1e-8 ? expm1(t) / (1 - zipf.exponent) : log_x;
+}
+
+double zipf_h(double x) {
+    return exp(-zipf.exponent * log(x));
+}
+
+double zipf_h_integral_inverse(double x) {
+    double t = x * (1 - zipf.exponent);
+    if (t < -1) t = -1;
+    return fabs(t) > 1e-8 ? exp(log1p(t) / (1 - zipf.exponent)) : exp(x);
+}
+
+void zipf_init(double exponent, int64_t n) {
+    zipf.exponent = exponent;
+    zipf.h_integral_x1 = zipf_h_integral(1.5) - 1;
+    zipf.h_integral_n = zipf_h_integral(n + 0.5);
+    zipf.s = 2 - zipf_h_integral_inverse(zipf_h_integral(2.5) - zipf_h(2));
+}
+
+// Draws a rank in [1, n] with probability proportional to rank^-exponent
+// in constant time, without a table (Hormann and Derflinger's
+// rejection-inversion method).
+int64_t zipf_sample(uint64_t *state, int64_t n) {
+    while (1) {
+        double u = zipf.h_integral_n + random_unit(state) * (zipf.h_integral_x1 - zipf.h_integral_n);
+        double x = zipf_h_integral_inverse(u);
+        int64_t k = (int64_t)(x + 0.5);
+        if (k < 1) k = 1;
+        if (k > n) k = n;
+        if (k - x <= zipf.s || u >= zipf_h_integral(k + 0.5) - zipf_h(k)) {
+            return k;
+        }
+    }
+}
+
+// Descends rmat_scale levels of the adjacency matrix, picking a quadrant at
+// each level with probabilities a, b, c and 1 - a - b - c. Ids that land
+// past vertex_count are redrawn.
+Edge rmat_edge(uint64_t *state) {
+    while (1) {
+        int64_t source = 0, dest = 0;
+        for (int level = 0; level < rmat_scale; level++) {
+            double r = random_unit(state);
+            int row = 0, column = 0;
+            if (r >= options.rmat_a + options.rmat_b + options.rmat_c) {
+                row = column = 1;
+            } else if (r >= options.rmat_a + options.rmat_b) {
+                row = 1;
+            } else if (r >= options.rmat_a) {
+                column = 1;
+            }
+            source = (source << 1) | row;
+            dest = (dest << 1) | column;
+        }
+        if (source < options.vertex_count && dest < options.vertex_count) {
+            Edge edge = {(int32_t)(source + 1), (int32_t)(dest + 1)};
+            return edge;
+        }
+    }
+}
+
+Edge random_edge(uint64_t *state) {
+    Edge edge;
+    switch (options.model) {
+    case MODEL_RMAT:
+        return rmat_edge(state);
+    case MODEL_ZIPF:
+        // Skew goes on the dests, which is what the reducers partition on.
+        edge.source = (int32_t)(1 + random_below(state, options.vertex_count));
+        edge.dest = (int32_t)zipf_sample(state, options.vertex_count);
+        return edge;
+    default:
+        edge.source = (int32_t)(1 + random_below(state, options.vertex_count));
+        edge.dest = (int32_t)(1 + random_below(state, options.vertex_count));
+        return edge;
+    }
+}
+
+// Fills edges for one chunk. A duplicate repeats one of the chunk's last
+// DUPLICATE_WINDOW edges, so duplicates stay close together the way
+// repeated crawls or logs produce them.
+void generate_chunk(uint64_t chunk, Edge *edges, int count) {
+    uint64_t state = options.seed ^ (chunk * 0xd1b54a32d192ed03ull);
+    splitmix64(&state);
+    
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && options.duplicates > 0 && random_unit(&state) < options.duplicates) {
+            int window = i < DUPLICATE_WINDOW ? i : DUPLICATE_WINDOW;
+            edges[i] = edges[i - 1 - (int)random_below(&state, window)];
+        } else {
+            edges[i] = random_edge(&state);
+        }
+    }
+}
+
+void buffer_reserve(ByteBuffer *buffer, size_t needed) {
+    if (buffer->capacity - buffer->length >= needed) return;
+    
+    size_t capacity = buffer->capacity ? buffer->capacity : 1 << 20;
+    while (capacity - buffer->length < needed) capacity *= 2;
+    buffer->data = realloc(buffer->data, capacity);
+    if (!buffer->data) {
+        perror("realloc");
+        exit(1);
+    }
+    buffer->capacity = capacity;
+}
+
+size_t format_int(char *p, int32_t value) {
+    char digits[12];
+    char *q = digits + sizeof(digits);
+    uint32_t magnitude = (uint32_t)value;
+    do {
+        *--q = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    size_t length = (size_t)(digits + sizeof(digits) - q);
+    memcpy(p, q, length);
+    return length;
+}
+
+void encode_text(const Edge *edges, int count, ByteBuffer *out) {
+    buffer_reserve(out, (size_t)count * TEXT_BYTES_PER_EDGE);
+    char *p = out->data + out->length;
+    for (int i = 0; i < count; i++) {
+        p += format_int(p, edges[i].source);
+        *p++ = ' ';
+        p += format_int(p, edges[i].dest);
+        *p++ = '\n';
+    }
+    out->length = (size_t)(p - out->data);
+}
+
+void put_le16(unsigned char *p, unsigned value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+}
+
+void put_le32(unsigned char *p, uint32_t value) {
+    put_le16(p, value & 0xffff);
+    put_le16(p + 2, value >> 16);
+}
+
+// Appends data as one BGZF block. A BGZF file is an ordinary multi-member
+// gzip file whose members record their own length, which lets findsp and
+// findst inflate it in parallel.
+void append_bgzf_block(ByteBuffer *out, const char *data, size_t length) {
+    buffer_reserve(out, BGZF_HEADER_SIZE + compressBound(length) + BGZF_FOOTER_SIZE);
+    unsigned char *block = (unsigned char *)out->data + out->length;
+    
+    static const unsigned char header[BGZF_HEADER_SIZE] = {
+        0x1f, 0x8b, 8, 0x04, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+    };
+    memcpy(block, header, BGZF_HEADER_SIZE);
+    
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "deflateInit2 failed\n");
+        exit(1);
+    }
+    stream.next_in = (unsigned char *)data;
+    stream.avail_in = (uInt)length;
+    stream.next_out = block + BGZF_HEADER_SIZE;
+    stream.avail_out = (uInt)compressBound(length);
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "deflate failed\n");
+        exit(1);
+    }
+    size_t compressed = stream.total_out;
+    deflateEnd(&stream);
+    
+    unsigned char *footer = block + BGZF_HEADER_SIZE + compressed;
+    put_le32(footer, (uint32_t)crc32(0, (const unsigned char *)data, (uInt)length));
+    put_le32(footer + 4, (uint32_t)length);
+    
+    size_t total = BGZF_HEADER_SIZE + compressed + BGZF_FOOTER_SIZE;
+    put_le16(block + 16, (unsigned)(total - 1));
+    out->length += total;
+}
+
+void encode_gzip(const Edge *edges, int count, ByteBuffer *text, ByteBuffer *out) {
+    text->length = 0;
+    encode_text(edges, count, text);
+    for (size_t offset = 0; offset < text->length; offset += BGZF_BLOCK_INPUT) {
+        size_t length = text->length - offset;
+        if (length > BGZF_BLOCK_INPUT) length = BGZF_BLOCK_INPUT;
+        append_bgzf_block(out, text->data + offset, length);
+    }
+}
+
+void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            perror("write");
+            exit(1);
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+int claim_chunk(Writer *writer, uint64_t *chunk) {
+    pthread_mutex_lock(&writer->mutex);
+    int claimed = writer->next_chunk < writer->chunk_count;
+    if (claimed) {
+        *chunk = writer->next_chunk++;
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return claimed;
+}
+
+// Workers encode chunks concurrently but write them strictly in chunk
+// order, so at most thread_count encoded chunks are in memory at once.
+void *generator_thread(void *arg) {
+    Writer *writer = (Writer *)arg;
+    Edge *edges = malloc(CHUNK_EDGES * sizeof(Edge));
+    ByteBuffer out = {0};
+    ByteBuffer text = {0};
+    uint64_t chunk;
+    
+    while (claim_chunk(writer, &chunk)) {
+        uint64_t first = chunk * CHUNK_EDGES;
+        int count = (int)(options.edge_count - first < CHUNK_EDGES ? options.edge_count - first : CHUNK_EDGES);
+        generate_chunk(chunk, edges, count);
+        
+        out.length = 0;
+        if (options.format == FORMAT_BINARY) {
+            buffer_reserve(&out, count * sizeof(Edge));
+            memcpy(out.data, edges, count * sizeof(Edge));
+            out.length = count * sizeof(Edge);
+        } else if (options.format == FORMAT_GZIP) {
+            encode_gzip(edges, count, &text, &out);
+        } else {
+            encode_text(edges, count, &out);
+        }
+        
+        pthread_mutex_lock(&writer->mutex);
+        while (writer->next_write != chunk) {
+            pthread_cond_wait(&writer->turn, &writer->mutex);
+        }
+        pthread_mutex_unlock(&writer->mutex);
+        
+        write_all(writer->fd, out.data, out.length);
+        
+        pthread_mutex_lock(&writer->mutex);
+        writer->next_write++;
+        pthread_cond_broadcast(&writer->turn);
+        pthread_mutex_unlock(&writer->mutex);
+    }
+    
+    free(edges);
+    free(out.data);
+    free(text.data);
+    return NULL;
+}
+
+uint64_t parse_count(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (*end == 'K' || *end == 'k') value *= 1e3, end++;
+    else if (*end == 'M' || *end == 'm') value *= 1e6, end++;
+    else if (*end == 'G' || *end == 'g') value *= 1e9, end++;
+    if (end == text || *end != '\0' || value < 0) {
+        fprintf(stderr, "Invalid count: %s\n", text);
+        exit(1);
+    }
+    return (uint64_t)value;
+}
+
+int parse_model(const char *name) {
+    if (strcmp(name, "uniform") == 0) return MODEL_UNIFORM;
+    if (strcmp(name, "rmat") == 0) return MODEL_RMAT;
+    if (strcmp(name, "zipf") == 0) return MODEL_ZIPF;
+    fprintf(stderr, "Unknown model: %s\n", name);
+    exit(1);
+}
+
+int parse_format(const char *name) {
+    if (strcmp(name, "text") == 0) return FORMAT_TEXT;
+    if (strcmp(name, "binary") == 0) return FORMAT_BINARY;
+    if (strcmp(name, "gzip") == 0) return FORMAT_GZIP;
+    fprintf(stderr, "Unknown format: %s\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s OUTFILE|- EDGES [--model=uniform|rmat|zipf] [--vertices=N] [--duplicates=FRACTION] [--rmat=A,B,C] [--zipf=EXPONENT] [--format=text|binary|gzip] [--threads=N] [--seed=N]\n", argv[0]);
+        exit(1);
+    }
+    
+    const char *output_file = argv[1];
+    options.edge_count = parse_count(argv[2]);
+    options.vertex_count = 0;
+    options.seed = 1;
+    options.rmat_a = 0.57;
+    options.rmat_b = 0.19;
+    options.rmat_c = 0.19;
+    options.zipf_exponent = 1.0;
+    
+    for (int i = 3; i < argc; i++) {
+        if (strncmp(argv[i], "--model=", 8) == 0) {
+            options.model = parse_model(argv[i] + 8);
+        } else if (strncmp(argv[i], "--vertices=", 11) == 0) {
+            options.vertex_count = (int64_t)parse_count(argv[i] + 11);
+        } else if (strncmp(argv[i], "--duplicates=", 13) == 0) {
+            options.duplicates = atof(argv[i] + 13);
+        } else if (strncmp(argv[i], "--rmat=", 7) == 0) {
+            if (sscanf(argv[i] + 7, "%lf,%lf,%lf", &options.rmat_a, &options.rmat_b, &options.rmat_c) != 3) {
+                fprintf(stderr, "--rmat takes three probabilities A,B,C\n");
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--zipf=", 7) == 0) {
+            options.zipf_exponent = atof(argv[i] + 7);
+        } else if (strncmp(argv[i], "--format=", 9) == 0) {
+            options.format = parse_format(argv[i] + 9);
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            options.thread_count = atoi(argv[i] + 10);
+        } else if (strncmp(argv[i], "--seed=", 7) == 0) {
+            options.seed = strtoull(argv[i] + 7, NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    
+    if (options.vertex_count <= 0) {
+        options.vertex_count = options.edge_count / 10 > 0 ? (int64_t)(options.edge_count / 10) : 1;
+    }
+    if (options.vertex_count > INT32_MAX) {
+        fprintf(stderr, "--vertices must be at most %d\n", INT32_MAX);
+        exit(1);
+    }
+    if (options.duplicates < 0 || options.duplicates >= 1) {
+        fprintf(stderr, "--duplicates must be in [0, 1)\n");
+        exit(1);
+    }
+    if (options.rmat_a < 0 || options.rmat_b < 0 || options.rmat_c < 0 ||
+        options.rmat_a + options.rmat_b + options.rmat_c > 1) {
+        fprintf(stderr, "--rmat probabilities must be non-negative and sum to at most 1\n");
+        exit(1);
+    }
+    if (options.zipf_exponent <= 0) {
+        fprintf(stderr, "--zipf exponent must be positive\n");
+        exit(1);
+    }
+    if (options.thread_count <= 0) {
+        options.thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (options.thread_count <= 0) options.thread_count = 1;
+    }
+    
+    while ((int64_t)1 << rmat_scale < options.vertex_count) rmat_scale++;
+    zipf_init(options.zipf_exponent, options.vertex_count);
+    
+    Writer writer;
+    writer.fd = STDOUT_FILENO;
+    if (strcmp(output_file, "-") != 0) {
+        writer.fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (writer.fd < 0) {
+            perror("Error creating output file");
+            exit(1);
+        }
+    }
+    writer.chunk_count = (options.edge_count + CHUNK_EDGES - 1) / CHUNK_EDGES;
+    writer.next_chunk = 0;
+    writer.next_write = 0;
+    pthread_mutex_init(&writer.mutex, NULL);
+    pthread_cond_init(&writer.turn, NULL);
+    
+    pthread_t *threads = malloc(options.thread_count * sizeof(pthread_t));
+    for (int i = 0; i < options.thread_count; i++) {
+        if (pthread_create(&threads[i], NULL, generator_thread, &writer) != 0) {
+            perror("Failed to create generator thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < options.thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    
+    // The empty block is BGZF's end-of-file marker.
+    if (options.format == FORMAT_GZIP) {
+        ByteBuffer eof = {0};
+        append_bgzf_block(&eof, "", 0);
+        write_all(writer.fd, eof.data, eof.length);
+        free(eof.data);
+    }
+    
+    if (writer.fd != STDOUT_FILENO && close(writer.fd) != 0) {
+        perror("close");
+        exit(1);
+    }
+    pthread_mutex_destroy(&writer.mutex);
+    pthread_cond_destroy(&writer.turn);
+    
+    return 0;
+}